@@ -0,0 +1,742 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+#ifndef NO_ZSTD
+#include <zstd.h>
+#endif
+#ifndef NO_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "block_reader.h"
+
+// size of the input reads
+static const size_t input_chunk = 256*1024;
+
+block_reader::block_reader ( std::istream *input, const char *prefix, size_t prefix_len, const int mode, const size_t headroom,
+		const size_t block_size, const unsigned nthreads, const inflate_point *resume ) :
+	input(input),
+	mode(mode),
+	headroom(headroom),
+	block_size(block_size),
+	badstream(false),
+	pending(prefix, prefix_len),
+	pending_off(0),
+	input_eof(false),
+	input_done(false),
+	next_seq(0),
+	end_seq(0),
+	end_found(false),
+	cons_seq(0),
+	held_cur(-1),
+	held_prev(-1),
+	stop(false),
+	cons_eof(false),
+	resuming(resume != NULL)
+{
+	if ( resume )
+		this->resume = *resume;
+
+	pthread_mutex_init( &lock, NULL );
+	pthread_cond_init( &cond, NULL );
+	pthread_mutex_init( &input_lock, NULL );
+
+	unsigned nprod = ( mode == MODE_BGZF && nthreads > 1 ? nthreads : 1 );
+
+	// enough slots for the producers to work while the consumer holds 2 blocks
+	slots.resize( nprod + 3 );
+	for ( unsigned i = 0 ; i < slots.size() ; ++i )
+	{
+		slots[ i ].mem = new char[ headroom + block_size ];
+		slots[ i ].len = 0;
+		slots[ i ].seq = 0;
+		slots[ i ].state = SLOT_FREE;
+	}
+
+	threads.resize( nprod );
+	for ( unsigned i = 0 ; i < nprod ; ++i )
+		if ( pthread_create( &threads[ i ], NULL, producer_thread, this ) )
+		{
+			std::cerr << "Cannot create thread: " << strerror( errno ) << std::endl;
+			threads.resize( i );
+			break;
+		}
+
+	if ( threads.empty() )
+		badstream = true;
+}
+
+block_reader::~block_reader ( )
+{
+	pthread_mutex_lock( &lock );
+	stop = true;
+	pthread_cond_broadcast( &cond );
+	pthread_mutex_unlock( &lock );
+
+	for ( unsigned i = 0 ; i < threads.size() ; ++i )
+		pthread_join( threads[ i ], NULL );
+
+	for ( unsigned i = 0 ; i < slots.size() ; ++i )
+		delete[] slots[ i ].mem;
+
+	pthread_mutex_destroy( &input_lock );
+	pthread_cond_destroy( &cond );
+	pthread_mutex_destroy( &lock );
+}
+
+bool block_reader::failed ( ) const
+{
+	return badstream;
+}
+
+bool block_reader::eof ( ) const
+{
+	return cons_eof;
+}
+
+bool block_reader::is_bgzf ( const char *data, size_t len )
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	// gzip magic, deflate, FEXTRA
+	if ( len < 18 || p[ 0 ] != 0x1f || p[ 1 ] != 0x8b || p[ 2 ] != 8 || !( p[ 3 ] & 4 ) )
+		return false;
+
+	size_t xlen = p[ 10 ] | ( p[ 11 ] << 8 );
+	if ( 12 + xlen > len )
+		return false;
+
+	for ( size_t off = 12 ; off + 4 <= 12 + xlen ; )
+	{
+		size_t slen = p[ off + 2 ] | ( p[ off + 3 ] << 8 );
+		if ( p[ off ] == 'B' && p[ off + 1 ] == 'C' && slen == 2 )
+			return true;
+		off += 4 + slen;
+	}
+
+	return false;
+}
+
+int block_reader::compression_mode ( const char *data, size_t len )
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+#ifndef NO_ZLIB
+	if ( len >= 2 && p[ 0 ] == 0x1f && p[ 1 ] == 0x8b )
+		return ( is_bgzf( data, len ) ? MODE_BGZF : MODE_GZIP );
+#endif
+#ifndef NO_ZSTD
+	if ( len >= 4 && p[ 0 ] == 0x28 && p[ 1 ] == 0xb5 && p[ 2 ] == 0x2f && p[ 3 ] == 0xfd )
+		return MODE_ZSTD;
+#endif
+#ifndef NO_LZ4
+	if ( len >= 4 && p[ 0 ] == 0x04 && p[ 1 ] == 0x22 && p[ 2 ] == 0x4d && p[ 3 ] == 0x18 )
+		return MODE_LZ4;
+#endif
+
+	(void)p;
+	return MODE_RAW;
+}
+
+size_t block_reader::read_input ( char *ptr, size_t len )
+{
+	size_t done = 0;
+
+	if ( pending_off < pending.size() )
+	{
+		done = pending.size() - pending_off;
+		if ( done > len )
+			done = len;
+		memcpy( ptr, pending.data() + pending_off, done );
+		pending_off += done;
+	}
+
+	if ( done < len && !input_eof )
+	{
+		input->read( ptr + done, len - done );
+		done += input->gcount();
+		if ( !input->good() )
+			input_eof = true;
+	}
+
+	return done;
+}
+
+bool block_reader::fill_pending ( size_t n )
+{
+	while ( pending.size() - pending_off < n && !input_eof )
+	{
+		if ( pending_off > 0 )
+		{
+			pending.erase( 0, pending_off );
+			pending_off = 0;
+		}
+
+		size_t old = pending.size();
+		size_t want = ( n - old > input_chunk ? n - old : input_chunk );
+		pending.resize( old + want );
+		input->read( &pending[ old ], want );
+		pending.resize( old + input->gcount() );
+		if ( !input->good() )
+			input_eof = true;
+	}
+
+	return pending.size() - pending_off >= n;
+}
+
+block_reader::slot *block_reader::start_block ( )
+{
+	pthread_mutex_lock( &lock );
+
+	slot *s = &slots[ next_seq % slots.size() ];
+	while ( !stop && s->state != SLOT_FREE )
+		pthread_cond_wait( &cond, &lock );
+
+	if ( stop )
+	{
+		pthread_mutex_unlock( &lock );
+		return NULL;
+	}
+
+	s->state = SLOT_FILLING;
+	s->seq = next_seq++;
+	s->len = 0;
+
+	pthread_mutex_unlock( &lock );
+
+	return s;
+}
+
+void block_reader::finish_block ( slot *s, bool last )
+{
+	pthread_mutex_lock( &lock );
+
+	if ( last )
+	{
+		// empty last block: do not hand it out
+		unsigned end = ( s->len == 0 ? s->seq : s->seq + 1 );
+		if ( !end_found || end < end_seq )
+			end_seq = end;
+		end_found = true;
+		if ( s->len == 0 )
+			s->state = SLOT_FREE;
+	}
+
+	if ( s->state == SLOT_FILLING )
+		s->state = SLOT_READY;
+
+	pthread_cond_broadcast( &cond );
+	pthread_mutex_unlock( &lock );
+}
+
+bool block_reader::next ( char* *data, size_t *len )
+{
+	pthread_mutex_lock( &lock );
+
+	// the consumer is done with the block before the previous one
+	if ( held_prev != -1 )
+	{
+		slots[ held_prev ].state = SLOT_FREE;
+		pthread_cond_broadcast( &cond );
+	}
+	held_prev = held_cur;
+	held_cur = -1;
+
+	slot *s = &slots[ cons_seq % slots.size() ];
+	while ( !( end_found && cons_seq >= end_seq ) && !( s->state == SLOT_READY && s->seq == cons_seq ) )
+		pthread_cond_wait( &cond, &lock );
+
+	if ( end_found && cons_seq >= end_seq )
+	{
+		cons_eof = true;
+		pthread_mutex_unlock( &lock );
+		return false;
+	}
+
+	s->state = SLOT_IN_USE;
+	held_cur = cons_seq % slots.size();
+	++cons_seq;
+
+	pthread_mutex_unlock( &lock );
+
+	*data = s->mem + headroom;
+	*len = s->len;
+
+	return true;
+}
+
+// read the input as is
+void block_reader::produce_raw ( )
+{
+	bool done = false;
+
+	while ( !done )
+	{
+		slot *s = start_block();
+		if ( !s )
+			break;
+
+		s->len = read_input( s->mem + headroom, block_size );
+		done = ( s->len < block_size );
+		finish_block( s, done );
+	}
+}
+
+#ifndef NO_ZLIB
+// inflate a single gzip stream (possibly multi-member) sequentially
+void block_reader::produce_gzip ( )
+{
+	z_stream zs;
+	memset( &zs, 0, sizeof(zs) );
+	// 32: autodetect gzip/zlib header
+	if ( inflateInit2( &zs, 32 | 15 ) != Z_OK )
+	{
+		std::cerr << "inflateInit: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+		badstream = true;
+		slot *s = start_block();
+		if ( s )
+			finish_block( s, true );
+		return;
+	}
+
+	std::vector< char > zin( input_chunk );
+	bool input_end = false;
+	// the last inflate() call ended a gzip member
+	bool member_end = false;
+	// a new member follows a complete one, and no data was inflated from it yet
+	bool member_start = false;
+	bool done = false;
+	// resuming in a raw deflate stream: number of bytes of the gzip trailer to skip after its end, then parse the next member header
+	size_t raw_trailer = 0;
+
+	if ( resuming )
+	{
+		inflateReset2( &zs, -15 );
+		raw_trailer = 8;
+
+		if ( resume.bits )
+		{
+			char c = 0;
+			if ( read_input( &c, 1 ) == 1 )
+				inflatePrime( &zs, resume.bits, (unsigned char)c >> ( 8 - resume.bits ) );
+		}
+
+		if ( !resume.window.empty() )
+			inflateSetDictionary( &zs, (const Bytef *)resume.window.data(), resume.window.size() );
+	}
+
+	while ( !done )
+	{
+		slot *s = start_block();
+		if ( !s )
+			break;
+
+		zs.next_out = (Bytef *)s->mem + headroom;
+		zs.avail_out = block_size;
+
+		while ( zs.avail_out > 0 )
+		{
+			if ( zs.avail_in == 0 && !input_end )
+			{
+				size_t n = read_input( &zin[ 0 ], zin.size() );
+				if ( n == 0 )
+					input_end = true;
+				zs.next_in = (Bytef *)&zin[ 0 ];
+				zs.avail_in = n;
+			}
+
+			if ( member_end && raw_trailer > 0 )
+			{
+				// skip the trailer of the resumed member, back to gzip decoding with header parsing
+				size_t n = ( zs.avail_in < raw_trailer ? zs.avail_in : raw_trailer );
+				zs.next_in += n;
+				zs.avail_in -= n;
+				raw_trailer -= n;
+				if ( raw_trailer > 0 )
+				{
+					if ( input_end )
+					{
+						std::cerr << "inflate: unexpected end of file" << std::endl;
+						done = true;
+						break;
+					}
+					continue;
+				}
+				inflateReset2( &zs, 32 | 15 );
+				if ( zs.avail_in == 0 && !input_end )
+					continue;
+			}
+
+			if ( member_end )
+			{
+				if ( zs.avail_in == 0 )
+				{
+					done = true;
+					break;
+				}
+
+				// more data after the end of a member: should be another member
+				inflateReset( &zs );
+				member_end = false;
+				member_start = true;
+			}
+
+			size_t out_before = zs.avail_out;
+			int ret = inflate( &zs, Z_NO_FLUSH );
+			if ( ret == Z_STREAM_END )
+				member_end = true;
+			else if ( ret == Z_BUF_ERROR && input_end )
+			{
+				// no progress possible without more input
+				std::cerr << "inflate: unexpected end of file" << std::endl;
+				done = true;
+				break;
+			}
+			else if ( ret != Z_OK )
+			{
+				if ( member_start && ret == Z_DATA_ERROR )
+					std::cerr << "inflate: trailing data" << std::endl;
+				else
+					std::cerr << "inflate: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+				done = true;
+				break;
+			}
+
+			if ( zs.avail_out != out_before )
+				member_start = false;
+		}
+
+		s->len = block_size - zs.avail_out;
+		finish_block( s, done );
+	}
+
+	inflateEnd( &zs );
+}
+
+bool block_reader::read_bgzf_members ( slot *s )
+{
+	s->zdata.clear();
+	size_t out = 0;
+
+	while ( 1 )
+	{
+		if ( !fill_pending( 18 ) )
+		{
+			if ( pending.size() > pending_off )
+				std::cerr << "bgzf: truncated member header" << std::endl;
+			return false;
+		}
+
+		const unsigned char *p = (const unsigned char *)pending.data() + pending_off;
+		if ( !is_bgzf( (const char *)p, pending.size() - pending_off ) )
+		{
+			if ( !fill_pending( 12 + ( p[ 10 ] | ( p[ 11 ] << 8 ) ) ) || p[ 0 ] != 0x1f || p[ 1 ] != 0x8b )
+			{
+				std::cerr << "inflate: trailing data" << std::endl;
+				return false;
+			}
+			p = (const unsigned char *)pending.data() + pending_off;
+			if ( !is_bgzf( (const char *)p, pending.size() - pending_off ) )
+			{
+				std::cerr << "bgzf: member without block size" << std::endl;
+				return false;
+			}
+		}
+
+		// find the BC subfield
+		size_t xlen = p[ 10 ] | ( p[ 11 ] << 8 );
+		size_t member_len = 0;
+		for ( size_t off = 12 ; off + 4 <= 12 + xlen ; off += 4 + ( p[ off + 2 ] | ( p[ off + 3 ] << 8 ) ) )
+			if ( p[ off ] == 'B' && p[ off + 1 ] == 'C' )
+			{
+				member_len = ( p[ off + 4 ] | ( p[ off + 5 ] << 8 ) ) + 1;
+				break;
+			}
+
+		if ( member_len < 12 + xlen + 8 || !fill_pending( member_len ) )
+		{
+			std::cerr << "bgzf: truncated member" << std::endl;
+			return false;
+		}
+
+		p = (const unsigned char *)pending.data() + pending_off;
+		const unsigned char *t = p + member_len - 4;
+		size_t isize = t[ 0 ] | ( t[ 1 ] << 8 ) | ( t[ 2 ] << 16 ) | ( (size_t)t[ 3 ] << 24 );
+
+		// keep the member for the next block
+		if ( out > 0 && out + isize > block_size )
+			return true;
+
+		s->zdata.append( (const char *)p, member_len );
+		pending_off += member_len;
+		out += isize;
+
+		if ( out >= block_size )
+			return true;
+	}
+}
+
+// inflate groups of BGZF members in parallel
+void block_reader::produce_bgzf ( )
+{
+	z_stream zs;
+	memset( &zs, 0, sizeof(zs) );
+	// 16: gzip header only
+	if ( inflateInit2( &zs, 16 | 15 ) != Z_OK )
+	{
+		std::cerr << "inflateInit: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+		badstream = true;
+		// end the stream here, so that the consumer and the other threads stop
+		pthread_mutex_lock( &input_lock );
+		input_done = true;
+		slot *s = start_block();
+		if ( s )
+			finish_block( s, true );
+		pthread_mutex_unlock( &input_lock );
+		return;
+	}
+
+	while ( 1 )
+	{
+		pthread_mutex_lock( &input_lock );
+		if ( input_done )
+		{
+			pthread_mutex_unlock( &input_lock );
+			break;
+		}
+
+		slot *s = start_block();
+		if ( !s )
+		{
+			pthread_mutex_unlock( &input_lock );
+			break;
+		}
+
+		bool last = !read_bgzf_members( s );
+		if ( last )
+			input_done = true;
+		pthread_mutex_unlock( &input_lock );
+
+		zs.next_in = (Bytef *)s->zdata.data();
+		zs.avail_in = s->zdata.size();
+		zs.next_out = (Bytef *)s->mem + headroom;
+		zs.avail_out = block_size;
+
+		while ( zs.avail_in > 0 )
+		{
+			int ret = inflate( &zs, Z_NO_FLUSH );
+			if ( ret == Z_STREAM_END )
+				inflateReset( &zs );
+			else if ( ret != Z_OK )
+			{
+				std::cerr << "inflate: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+				inflateReset( &zs );
+				// do not hand out data following a corrupted block
+				pthread_mutex_lock( &input_lock );
+				input_done = true;
+				pthread_mutex_unlock( &input_lock );
+				last = true;
+				break;
+			}
+		}
+
+		s->len = block_size - zs.avail_out;
+		finish_block( s, last );
+	}
+
+	inflateEnd( &zs );
+}
+#else
+void block_reader::produce_gzip ( )
+{
+	slot *s = start_block();
+	if ( s )
+		finish_block( s, true );
+}
+
+void block_reader::produce_bgzf ( )
+{
+	produce_gzip();
+}
+#endif
+
+#ifndef NO_ZSTD
+// decompress a zstd stream (possibly many frames)
+void block_reader::produce_zstd ( )
+{
+	ZSTD_DStream *zds = ZSTD_createDStream();
+	if ( !zds || ZSTD_isError( ZSTD_initDStream( zds ) ) )
+	{
+		std::cerr << "zstd: cannot create decompression context" << std::endl;
+		badstream = true;
+		slot *s = start_block();
+		if ( s )
+			finish_block( s, true );
+		if ( zds )
+			ZSTD_freeDStream( zds );
+		return;
+	}
+
+	std::vector< char > zin( ZSTD_DStreamInSize() );
+	ZSTD_inBuffer in = { &zin[ 0 ], 0, 0 };
+	bool input_end = false;
+	// 0 once the current frame is fully decoded and flushed
+	size_t hint = 0;
+	bool done = false;
+
+	while ( !done )
+	{
+		slot *s = start_block();
+		if ( !s )
+			break;
+
+		ZSTD_outBuffer out = { s->mem + headroom, block_size, 0 };
+
+		while ( out.pos < out.size )
+		{
+			if ( in.pos == in.size && !input_end )
+			{
+				in.size = read_input( &zin[ 0 ], zin.size() );
+				in.pos = 0;
+				if ( in.size == 0 )
+					input_end = true;
+			}
+
+			size_t in_before = in.pos;
+			size_t out_before = out.pos;
+			size_t ret = ZSTD_decompressStream( zds, &out, &in );
+			if ( ZSTD_isError( ret ) )
+			{
+				std::cerr << "zstd: " << ZSTD_getErrorName( ret ) << std::endl;
+				done = true;
+				break;
+			}
+
+			if ( in.pos != in_before || out.pos != out_before )
+				hint = ret;
+			else if ( input_end )
+			{
+				if ( hint != 0 )
+					std::cerr << "zstd: unexpected end of file" << std::endl;
+				done = true;
+				break;
+			}
+		}
+
+		s->len = out.pos;
+		finish_block( s, done );
+	}
+
+	ZSTD_freeDStream( zds );
+}
+#endif
+
+#ifndef NO_LZ4
+// decompress a lz4 frame stream (possibly many frames)
+void block_reader::produce_lz4 ( )
+{
+	LZ4F_dctx *dctx = NULL;
+	if ( LZ4F_isError( LZ4F_createDecompressionContext( &dctx, LZ4F_VERSION ) ) )
+	{
+		std::cerr << "lz4: cannot create decompression context" << std::endl;
+		badstream = true;
+		slot *s = start_block();
+		if ( s )
+			finish_block( s, true );
+		return;
+	}
+
+	std::vector< char > zin( input_chunk );
+	size_t in_pos = 0;
+	size_t in_len = 0;
+	bool input_end = false;
+	// 0 once the current frame is fully decoded and flushed
+	size_t hint = 0;
+	bool done = false;
+
+	while ( !done )
+	{
+		slot *s = start_block();
+		if ( !s )
+			break;
+
+		char *dst = s->mem + headroom;
+		size_t out = 0;
+
+		while ( out < block_size )
+		{
+			if ( in_pos == in_len && !input_end )
+			{
+				in_len = read_input( &zin[ 0 ], zin.size() );
+				in_pos = 0;
+				if ( in_len == 0 )
+					input_end = true;
+			}
+
+			size_t dst_size = block_size - out;
+			size_t src_size = in_len - in_pos;
+			size_t ret = LZ4F_decompress( dctx, dst + out, &dst_size, &zin[ 0 ] + in_pos, &src_size, NULL );
+			if ( LZ4F_isError( ret ) )
+			{
+				std::cerr << "lz4: " << LZ4F_getErrorName( ret ) << std::endl;
+				done = true;
+				break;
+			}
+			in_pos += src_size;
+			out += dst_size;
+
+			if ( src_size != 0 || dst_size != 0 )
+				hint = ret;
+			else if ( input_end )
+			{
+				if ( hint != 0 )
+					std::cerr << "lz4: unexpected end of file" << std::endl;
+				done = true;
+				break;
+			}
+		}
+
+		s->len = out;
+		finish_block( s, done );
+	}
+
+	LZ4F_freeDecompressionContext( dctx );
+}
+#endif
+
+void *block_reader::producer_thread ( void *arg )
+{
+	block_reader *self = (block_reader *)arg;
+
+	switch ( self->mode )
+	{
+	case MODE_BGZF:
+		self->produce_bgzf();
+		break;
+
+	case MODE_GZIP:
+		self->produce_gzip();
+		break;
+
+#ifndef NO_ZSTD
+	case MODE_ZSTD:
+		self->produce_zstd();
+		break;
+#endif
+
+#ifndef NO_LZ4
+	case MODE_LZ4:
+		self->produce_lz4();
+		break;
+#endif
+
+	default:
+		self->produce_raw();
+	}
+
+	return NULL;
+}
@@ -0,0 +1,141 @@
+#ifndef BLOCK_READER_H
+#define BLOCK_READER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/*
+ * Read an input stream from background threads, and hand out its decompressed content as a sequence of large memory blocks
+ *
+ * Uncompressed streams are read ahead by a dedicated thread (MODE_RAW), so that reads and parsing overlap.
+ * gzip streams (including multi-member streams) are inflated by a dedicated thread.
+ * BGZF streams (gzip members holding their compressed size in a header extra field, eg from bgzip) are inflated in parallel,
+ * each thread inflating a block worth of members.
+ * zstd and lz4 frame streams are decompressed by a dedicated thread (unless compiled with -DNO_ZSTD / -DNO_LZ4).
+ *
+ * Blocks are handed out in stream order. Each block is preceded by 'headroom' writable bytes, so that the consumer can prepend
+ * the end of the previous block without a memmove.
+ */
+class block_reader
+{
+public:
+	// state to resume inflating a gzip stream from the middle of a deflate stream (see row_index)
+	// the input must be positioned at the byte holding the first bits to decode
+	struct inflate_point {
+		int bits;		// number of not yet decoded high bits of the byte before in_off (0: start at a byte boundary)
+		std::string window;	// uncompressed data preceding the resume point (up to 32KB)
+	};
+
+	enum {
+		MODE_RAW,
+		MODE_GZIP,
+		MODE_BGZF,
+		MODE_ZSTD,
+		MODE_LZ4,
+	};
+
+private:
+	enum {
+		SLOT_FREE,
+		SLOT_FILLING,
+		SLOT_READY,
+		SLOT_IN_USE,
+	};
+
+	struct slot {
+		char *mem;		// headroom + block_size bytes
+		size_t len;		// length of the data, starting at mem + headroom
+		unsigned seq;		// index of the block in the stream
+		int state;
+		std::string zdata;	// compressed members (MODE_BGZF)
+	};
+
+	std::istream *input;
+	int mode;
+	size_t headroom;
+	size_t block_size;
+	bool badstream;
+
+	// input data read but not consumed yet (starts with the bytes sniffed by the caller)
+	std::string pending;
+	size_t pending_off;
+	bool input_eof;
+	// set when the producers must not read more input (end of input, or decompression error)
+	bool input_done;
+
+	std::vector< slot > slots;
+	std::vector< pthread_t > threads;
+
+	// protects everything below, and the slot states
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// serializes the input reads, held from the choice of a block seq to the end of the read of its data
+	pthread_mutex_t input_lock;
+
+	unsigned next_seq;	// next block to be produced
+	unsigned end_seq;	// number of blocks in the stream, valid if end_found
+	bool end_found;
+	unsigned cons_seq;	// next block to be handed out
+	int held_cur;		// slots handed out to the consumer, still in use
+	int held_prev;
+	bool stop;
+	bool cons_eof;
+
+	// MODE_GZIP: start inflating the raw deflate stream at this point instead of the beginning of a gzip stream
+	bool resuming;
+	inflate_point resume;
+
+	// read up to len bytes of input (pending data first), return the length read
+	size_t read_input ( char *ptr, size_t len );
+
+	// ensure at least n bytes are available in pending, return false on end of input
+	bool fill_pending ( size_t n );
+
+	// wait for a free slot for the next block, mark it as filling
+	// return NULL if the reader is stopping
+	slot *start_block ( );
+	void finish_block ( slot *s, bool last );
+
+	void produce_raw ( );
+	void produce_gzip ( );
+	void produce_bgzf ( );
+	void produce_zstd ( );
+	void produce_lz4 ( );
+
+	// read the next BGZF members of the input in s->zdata, up to block_size of uncompressed data
+	// return false at the end of the input
+	bool read_bgzf_members ( slot *s );
+
+	static void *producer_thread ( void *arg );
+
+public:
+	// prefix holds data already read from input by the caller
+	// nthreads is the number of decompression threads (MODE_BGZF)
+	// resume (MODE_GZIP only) is copied
+	explicit block_reader ( std::istream *input, const char *prefix, size_t prefix_len, const int mode, const size_t headroom,
+			const size_t block_size = 4*1024*1024, const unsigned nthreads = 1, const inflate_point *resume = NULL );
+	~block_reader ( );
+
+	bool failed ( ) const;
+
+	// return the next block of data, false at the end of the stream
+	// the block returned by the previous call stays valid until the next call
+	bool next ( char* *data, size_t *len );
+
+	// true once next() returned false
+	bool eof ( ) const;
+
+	// check if a stream starts with a BGZF member
+	static bool is_bgzf ( const char *data, size_t len );
+
+	// return the mode to use for a stream starting with data, from its magic ; MODE_RAW if not compressed (or support disabled)
+	static int compression_mode ( const char *data, size_t len );
+
+private:
+	block_reader ( const block_reader& );
+	block_reader& operator=( const block_reader& );
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+/*
+ * Runtime detection of the x86 vector extensions
+ *
+ * The binary is built for the baseline architecture (no -march), the vectorized kernels are compiled for each
+ * extension with __attribute__((target)) and the best one for the running cpu is chosen at startup.
+ * On other architectures, or with -DNO_CPU_DISPATCH, only the portable version of the kernels is used.
+ */
+
+#if !defined(NO_CPU_DISPATCH) && defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define CPU_DISPATCH
+#include <immintrin.h>
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+enum cpu_level {
+	CPU_GENERIC,
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_AVX512	// avx512f + avx512bw
+};
+
+#ifdef CPU_DISPATCH
+inline cpu_level cpu_detect_level ( )
+{
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" ) )
+		return CPU_AVX512;
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return CPU_AVX2;
+	if ( __builtin_cpu_supports( "sse2" ) )
+		return CPU_SSE2;
+
+	return CPU_GENERIC;
+}
+#endif
+
+// return the best vector extension supported by the cpu (and enabled by the os), detected once
+inline cpu_level cpu_best_level ( )
+{
+#ifdef CPU_DISPATCH
+	static const cpu_level level = cpu_detect_level();
+
+	return level;
+#else
+	return CPU_GENERIC;
+#endif
+}
+
+#endif
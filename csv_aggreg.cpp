@@ -14,10 +14,15 @@
 #include "csv_reader.h"
 #include "mmap_alloc.h"
 #include "murmur3.h"
+#include "num_conv.h"
 #include "page_tree.h"
+#include "prefetcher.h"
 
 #define CSV_AGGREG_VERSION "20140414"
 
+// number of input files read ahead of the one being aggregated
+static const int prefetch_depth = 4;
+
 /*
  * holds all possible forms of aggregation fields ; update as needed if you add aggregators
  */
@@ -40,20 +45,7 @@ static void str_key( char **field, size_t *field_len )
 
 static void key_out( u_data *ptr, output_buffer &out )
 {
-	out.append( '"' );
-	size_t len = strlen( ptr->key );
-	char *tmp = ptr->key, *tmp2;
-	while ( len > 0 && (tmp2 = (char *)memchr( tmp, '"', len )) )
-	{
-		++tmp2;
-		out.append( tmp, tmp2 - tmp );
-		out.append( '"' );
-		len -= tmp2 - tmp;
-		tmp = tmp2;
-	}
-	if ( len > 0 )
-		out.append( tmp, len );
-	out.append( '"' );
+	out.append_csv_field( ptr->key, strlen( ptr->key ) );
 }
 
 static void downcase_key( char **field, size_t *field_len )
@@ -62,7 +54,7 @@ static void downcase_key( char **field, size_t *field_len )
 		(*field)[ i ] = tolower( (*field)[ i ] );
 }
 
-static void top20_aggreg( u_data *ptr, const std::string *field, int first )
+static void top20_aggreg( u_data *ptr, const char *field, size_t len, int first )
 {
 	if ( first )
 		ptr->vec_str = new std::vector< std::string >;
@@ -71,26 +63,27 @@ static void top20_aggreg( u_data *ptr, const std::string *field, int first )
 		return;
 
 	for ( unsigned i = 0 ; i < ptr->vec_str->size() ; ++i )
-		if ( (*ptr->vec_str)[ i ] == *field )
+	{
+		const std::string &v = (*ptr->vec_str)[ i ];
+		if ( v.size() == len && ! memcmp( v.data(), field, len ) )
 			return;
+	}
 
-	ptr->vec_str->push_back( *field );
+	ptr->vec_str->push_back( std::string( field, len ) );
 }
 
-static void top20_merge( u_data *ptr, const std::string *field, int first )
+static void top20_merge( u_data *ptr, const char *field, size_t len, int first )
 {
-	size_t last = 0, next = field->find( ',' );
-	while ( next != std::string::npos )
+	const char *next;
+	while ( ( next = (const char *)memchr( field, ',', len ) ) )
 	{
-		const std::string &tmp = field->substr( last, next-last );
-		top20_aggreg( ptr, &tmp, first );
+		top20_aggreg( ptr, field, next - field, first );
 		first = 0;
-		last = next + 1;
-		next = field->find( ',', last );
+		len -= next + 1 - field;
+		field = next + 1;
 	}
 
-	const std::string &tmp = field->substr( last );
-	top20_aggreg( ptr, &tmp, first );
+	top20_aggreg( ptr, field, len, first );
 }
 
 static void top_out( u_data *ptr, output_buffer &out )
@@ -104,75 +97,73 @@ static void top_out( u_data *ptr, output_buffer &out )
 		tmp.append( (*ptr->vec_str)[ i ] );
 	}
 
-	out.append( csv_reader::escape_csv_string( tmp ) );
+	out.append_csv_field( tmp );
 
 	delete ptr->vec_str;
 	ptr->vec_str = NULL;
 }
 
-static void min_aggreg( u_data *ptr, const std::string *field, int first )
+static void min_aggreg( u_data *ptr, const char *field, size_t len, int first )
 {
-	long long val = strtoll( field->c_str(), 0, 0 );
+	long long val = parse_ll( field, len );
 	if ( first || val < ptr->ll )
 		ptr->ll = val;
 }
 
-static void max_aggreg( u_data *ptr, const std::string *field, int first )
+static void max_aggreg( u_data *ptr, const char *field, size_t len, int first )
 {
-	long long val = strtoll( field->c_str(), 0, 0 );
+	long long val = parse_ll( field, len );
 	if ( first || val > ptr->ll )
 		ptr->ll = val;
 }
 
 static void str_out( u_data *ptr, output_buffer &out )
 {
-	out.append( csv_reader::escape_csv_string( *ptr->str ) );
+	out.append_csv_field( *ptr->str );
 
 	delete ptr->str;
 	ptr->str = NULL;
 }
 
-static void minstr_aggreg( u_data *ptr, const std::string *field, int first )
+static void minstr_aggreg( u_data *ptr, const char *field, size_t len, int first )
 {
 	if ( first )
 		ptr->str = new std::string;
 
-	if ( first || *field < *ptr->str )
-		*ptr->str = *field;
+	if ( first || ptr->str->compare( 0, std::string::npos, field, len ) > 0 )
+		ptr->str->assign( field, len );
 }
 
-static void maxstr_aggreg( u_data *ptr, const std::string *field, int first )
+static void maxstr_aggreg( u_data *ptr, const char *field, size_t len, int first )
 {
 	if ( first )
 		ptr->str = new std::string;
 
-	if ( first || *field > *ptr->str )
-		*ptr->str = *field;
+	if ( first || ptr->str->compare( 0, std::string::npos, field, len ) < 0 )
+		ptr->str->assign( field, len );
 }
 
-static void count_aggreg( u_data *ptr, const std::string *field, int first )
+static void count_aggreg( u_data *ptr, const char *field, size_t len, int first )
 {
 	(void)field;
+	(void)len;
 	if ( first )
 		ptr->ll = 1;
 	else
 		++(ptr->ll);
 }
 
-static void count_merge( u_data *ptr, const std::string *field, int first )
+static void count_merge( u_data *ptr, const char *field, size_t len, int first )
 {
 	if ( first )
 		ptr->ll = 0;
-	ptr->ll += strtoll( field->c_str(), 0, 0 );
+	ptr->ll += parse_ll( field, len );
 }
 
 static void int_out( u_data *ptr, output_buffer &out )
 {
-	char buf[16];
-	unsigned buf_sz = snprintf( buf, sizeof(buf), "%lld", ptr->ll );
-	if ( buf_sz > sizeof(buf) )
-		buf_sz = sizeof(buf);
-	out.append( buf, buf_sz );
+	char buf[ 24 ];
+	out.append( buf, format_ll( buf, ptr->ll ) );
 }
 
 
@@ -183,10 +174,10 @@ static void int_out( u_data *ptr, output_buffer &out )
 struct aggreg_descriptor {
 	// aggregator name, used in config/help messages
 	const char *name;
-	// called during aggregation, ptr is the same as for alloc(), field is the unescaped csv field value, first = 1 if field is the 1st entry to be aggregated here
-	void (*aggreg)( u_data *ptr, const std::string *field, int first );
+	// called during aggregation, ptr is the same as for alloc(), field is the unescaped csv field value (len bytes, not nul-terminated), first = 1 if field is the 1st entry to be aggregated here
+	void (*aggreg)( u_data *ptr, const char *field, size_t len, int first );
 	// called during merge, similar to aggreg, but field points to the result of a previous out(aggreg())
-	void (*merge)( u_data *ptr, const std::string *field, int first );
+	void (*merge)( u_data *ptr, const char *field, size_t len, int first );
 	// determine aggregation key, should append data to key. field is the raw csv field value, it is neither escaped nor unescaped.
 	void (*key)( char **k, size_t *klen );
 	// called when dumping aggregation results, ptr is the same as for alloc().
@@ -261,6 +252,8 @@ private:
 
 	// csv reader line_max
 	unsigned line_max;
+	// csv reader readahead mode
+	bool readahead;
 
 	// describe one output (aggregated) column
 	struct aggreg_col {
@@ -308,7 +301,7 @@ private:
 			std::vector< struct aggreg_col * > &inv_conf_other )
 	{
 		std::vector< std::string > *headers;
-		csv_reader *reader = new csv_reader( filename, ',', '"', line_max );
+		csv_reader *reader = new csv_reader( filename, ',', '"', line_max, readahead );
 
 		if ( reader->failed_to_open() )
 			goto fail;
@@ -363,7 +356,7 @@ private:
 	csv_reader *start_reader_merge( const char *filename )
 	{
 		std::vector< std::string > *headers = NULL;
-		csv_reader *reader = new csv_reader( filename, ',', '"', line_max );
+		csv_reader *reader = new csv_reader( filename, ',', '"', line_max, readahead );
 
 		if ( reader->failed_to_open() )
 			goto fail;
@@ -458,9 +451,10 @@ private:
 
 
 public:
-	explicit csv_aggreg ( const std::string &bigtmp_directory = "", unsigned line_max = 64*1024 ) :
+	explicit csv_aggreg ( const std::string &bigtmp_directory = "", unsigned line_max = 64*1024, bool readahead = false ) :
 		memalloc( bigtmp_directory ),
 		line_max(line_max),
+		readahead(readahead),
 		u_data_aggreg( bigtmp_directory )
 	{
 	}
@@ -606,116 +600,109 @@ public:
 		if ( !reader )
 			return;
 
-		// hold unescaped field values for the current line
-		std::vector< char * > field( inv_conf.size() );
-		std::vector< size_t > field_len( inv_conf.size() );
+		// input rows, by batches stored column by column
+		csv_batch batch( inv_conf.size() );
+		const unsigned stride = batch.max_rows;
+
+		// hold unescaped field values for the current batch, indexed by input column then row
+		std::vector< char * > field( inv_conf.size() * stride );
+		std::vector< size_t > field_len( inv_conf.size() * stride );
+
+		// hold unescaped key data for the current batch, indexed by output column then row
+		std::vector< char * > batch_key( conf.size() * stride );
+		std::vector< size_t > batch_key_len( conf.size() * stride );
 
 		// hold unescaped key data for the current line
 		std::vector< char * > key( conf.size() );
 		std::vector< size_t > key_len( conf.size() );
 
-		// current line csv fields
-		char *line = NULL;
-		std::vector< unsigned > field_off( inv_conf.size() );
-
-		// hold pointers to string that were allocated for unescaping (unusual) ; to be freed at the end of the line
-		std::vector< std::string * > str_tofree( inv_conf.size() );
-
 		// maps input column -> output column index for keys
 		std::vector< int > key_idx( inv_conf.size(), -1 );
 		for ( unsigned i = 0 ; i < conf.size() ; ++i )
 			if ( conf[ i ].aggregator->key )
 				key_idx[ conf[ i ].input_col_idx ] = i;
 
-		do
+		// do not tokenize the columns after the last one used
+		unsigned max_fields = inv_conf.size();
+		while ( max_fields > 0 && key_idx[ max_fields - 1 ] == -1 && inv_conf[ max_fields - 1 ].empty() )
+			--max_fields;
+		reader->set_max_fields( max_fields );
+
+		while ( reader->read_batch( &batch ) )
 		{
-			// split line in csv fields
-			unsigned f_off = 0;
-			unsigned f_len = 0;
-			unsigned n_fields = 0;
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			// unescape the csv fields we're interested in, one column at a time
+			// the aggregated values cannot be updated this way: inserting a key in u_data_aggreg moves the values of other keys
+			for ( unsigned i = 0 ; i < inv_conf.size() ; ++i )
 			{
-				if ( n_fields >= inv_conf.size() )
+				int ki = key_idx[ i ];
+
+				if ( ki == -1 && ! inv_conf[ i ].size() )
 					continue;
 
-				field_off[ n_fields ] = f_off;
-				field_len[ n_fields ] = f_len;
+				for ( unsigned r = 0 ; r < batch.rows ; ++r )
+				{
+					if ( batch.field_count[ r ] < inv_conf.size() )
+						continue;
 
-				++n_fields;
-			}
+					// unescaped in place or in the reader scratch area, valid until the next batch
+					char *uf = batch.field( i, r );
+					unsigned ul = batch.length( i, r );
+					if ( ! batch.quote_free )
+						reader->unescape_csv_field( &uf, &ul );
 
-			if ( n_fields < inv_conf.size() )
-			{
-				unsigned snap_sz = f_off + f_len;
-				if ( snap_sz > 32 )
-					snap_sz = 32;
-				std::cerr << "Bad field count, skipping line near " << std::string( line, snap_sz ) << std::endl;
+					field[ i * stride + r ] = uf;
+					field_len[ i * stride + r ] = ul;
 
-				continue;
+					if ( ki != -1 )
+					{
+						batch_key[ ki * stride + r ] = uf;
+						batch_key_len[ ki * stride + r ] = ul;
+
+						conf[ ki ].aggregator->key( &batch_key[ ki * stride + r ], &batch_key_len[ ki * stride + r ] );
+					}
+				}
 			}
 
-			// unescape the csv fields we're interested in
-			for ( unsigned i = 0 ; i < n_fields ; ++i )
+			for ( unsigned r = 0 ; r < batch.rows ; ++r )
 			{
-				int ki = key_idx[ i ];
-
-				if ( ki != -1 || inv_conf[ i ].size() )
+				if ( batch.field_count[ r ] < inv_conf.size() )
 				{
-					char *uf = line + field_off[ i ];
-					unsigned ul = field_len[ i ];
-					std::string *s = reader->unescape_csv_field( &uf, &ul );
+					unsigned snap_sz = batch.row_length[ r ];
+					if ( snap_sz > 32 )
+						snap_sz = 32;
+					std::cerr << "Bad field count, skipping line near " << std::string( batch.row_start[ r ], snap_sz ) << std::endl;
 
-					if ( s )
-					{
-						str_tofree[ i ] = s;
-						uf = (char *)s->data();
-						ul = s->size();
-					}
-					field[ i ] = uf;
-					field_len[ i ] = ul;
+					continue;
+				}
 
-					if ( ki != -1 )
+				for ( unsigned i = 0 ; i < conf.size() ; ++i )
+					if ( conf[ i ].aggregator->key )
 					{
-						key[ ki ] = field[ i ];
-						key_len[ ki ] = field_len[ i ];
-
-						conf[ ki ].aggregator->key( &key[ ki ], &key_len[ ki ] );
+						key[ i ] = batch_key[ i * stride + r ];
+						key_len[ i ] = batch_key_len[ i * stride + r ];
 					}
-				}
-			}
 
-			// aggregate
-			int first = 0;
-			u_data *p = aggreg_find_or_create( key, key_len, &first );
+				// aggregate
+				int first = 0;
+				u_data *p = aggreg_find_or_create( key, key_len, &first );
 
-			for ( unsigned i = 0 ; i < n_fields ; ++i )
-			{
-				// TODO aggreg( fptr, flen )
-				if ( inv_conf[ i ].size() )
+				for ( unsigned i = 0 ; i < inv_conf.size() ; ++i )
 				{
-					std::string str( field[ i ], field_len[ i ] );
 					for ( unsigned j = 0 ; j < inv_conf[ i ].size() ; ++j )
 					{
 						struct aggreg_col *a = inv_conf[ i ][ j ];
-						a->aggregator->aggreg( p + a->aggreg_idx, &str, first );
+						a->aggregator->aggreg( p + a->aggreg_idx, field[ i * stride + r ], field_len[ i * stride + r ], first );
 					}
 				}
 
-				if ( str_tofree[ i ] )
+				// aggregate output columns not in inv_conf (eg count())
+				for ( unsigned i = 0 ; i < inv_conf_other.size() ; ++i )
 				{
-					delete str_tofree[ i ];
-					str_tofree[ i ] = NULL;
+					struct aggreg_col *a = inv_conf_other[ i ];
+					a->aggregator->aggreg( p + a->aggreg_idx, NULL, 0, first );
 				}
 			}
-
-			// aggregate output columns not in inv_conf (eg count())
-			for ( unsigned i = 0 ; i < inv_conf_other.size() ; ++i )
-			{
-				struct aggreg_col *a = inv_conf_other[ i ];
-				a->aggregator->aggreg( p + a->aggreg_idx, NULL, first );
-			}
-
-		} while ( reader->fetch_line() );
+		}
 
 		delete reader;
 	}
@@ -738,30 +725,17 @@ public:
 
 		// current line csv fields
 		char *line = NULL;
-		std::vector< unsigned > field_off( conf.size() );
-
-		// hold pointers to string that were allocated for unescaping (unusual) ; to be freed at the end of the line
-		std::vector< std::string * > str_tofree( conf.size() );
+		std::vector< unsigned > row_off, row_len;
 
 		do
 		{
 			// read fields
-			unsigned f_off = 0;
-			unsigned f_len = 0;
-			unsigned n_fields = 0;
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
-			{
-				if ( n_fields >= conf.size() )
-					continue;
-
-				field_off[ n_fields ] = f_off;
-				field_len[ n_fields ] = f_len;
-
-				++n_fields;
-			}
+			unsigned n_fields = reader->read_row( &line, &row_off, &row_len );
+			if ( n_fields > conf.size() )
+				n_fields = conf.size();
 			if ( n_fields < conf.size() )
 			{
-				unsigned snap_sz = f_off + f_len;
+				unsigned snap_sz = ( n_fields ? row_off[ n_fields - 1 ] + row_len[ n_fields - 1 ] : 0 );
 				if ( snap_sz > 32 )
 					snap_sz = 32;
 				std::cerr << "Bad field count, skipping line near " << std::string( line, snap_sz ) << std::endl;
@@ -771,16 +745,10 @@ public:
 
 			for ( unsigned i = 0 ; i < n_fields ; ++i )
 			{
-				char *uf = line + field_off[ i ];
-				unsigned ul = field_len[ i ];
-				std::string *s = reader->unescape_csv_field( &uf, &ul );
+				char *uf = line + row_off[ i ];
+				unsigned ul = row_len[ i ];
+				reader->unescape_csv_field( &uf, &ul );
 
-				if ( s )
-				{
-					str_tofree[ i ] = s;
-					uf = (char *)s->data();
-					ul = s->size();
-				}
 				field[ i ] = uf;
 				field_len[ i ] = ul;
 
@@ -800,16 +768,7 @@ public:
 			for ( unsigned i = 0 ; i < n_fields ; ++i )
 			{
 				if ( conf[ i ].aggregator->merge )
-				{
-					std::string s( field[ i ], field_len[ i ] );
-					conf[ i ].aggregator->merge( p + i, &s, first );
-				}
-
-				if ( str_tofree[ i ] )
-				{
-					delete str_tofree[ i ];
-					str_tofree[ i ] = NULL;
-				}
+					conf[ i ].aggregator->merge( p + i, field[ i ], field_len[ i ], first );
 			}
 
 		} while ( reader->fetch_line() );
@@ -820,18 +779,16 @@ public:
 
 	// dump all aggregated data to an output CSV
 	// clears aggreg
-	void dump_output( const char *filename )
+	void dump_output( const char *filename, const int compress )
 	{
-		output_buffer outbuf( filename, 1024*1024 );
+		output_buffer outbuf( filename, 1024*1024, false, 4, compress );
 
 		for ( unsigned i = 0 ; i < conf.size() ; ++i )
 		{
 			if ( i > 0 )
 				outbuf.append( ',' );
 
-			outbuf.append( '"' );
-			outbuf.append( conf[ i ].outname );
-			outbuf.append( '"' );
+			outbuf.append_csv_field( conf[ i ].outname );
 		}
 		outbuf.append_nl();
 
@@ -865,9 +822,11 @@ static const char *usage =
 "          -V                 display version information and exit\n"
 "          -h                 display help (this text) and exit\n"
 "          -o <outfile>       specify output file (default=stdout)\n"
+"          -z <format>        compress the output with gzip or zstd (default: from the outfile extension, .gz or .zst)\n"
 "          -L <max line len>  specify maximum line length allowed (default=64k)\n"
 "          -m                 inputs are partial outputs from csv_aggr (map-reduce style)\n"
 "          -d <directory>     directory to store temporary swap files ; should have lots of free space\n"
+"          -R                 read inputs from a background thread (no mmap), for slow storage\n"
 ;
 
 
@@ -882,11 +841,13 @@ int main ( int argc, char * argv[] )
 {
 	int opt;
 	char *outfile = NULL;
+	const char *out_compress = NULL;
 	unsigned line_max = 64*1024;
 	bool merge = false;
+	bool readahead = false;
 	std::string bigtmpdir = "";
 
-	while ( (opt = getopt(argc, argv, "hVo:L:md:")) != -1 )
+	while ( (opt = getopt(argc, argv, "hVo:z:L:md:R")) != -1 )
 	{
 		switch (opt)
 		{
@@ -902,6 +863,10 @@ int main ( int argc, char * argv[] )
 			outfile = optarg;
 			break;
 
+		case 'z':
+			out_compress = optarg;
+			break;
+
 		case 'L':
 			line_max = strtoul( optarg, NULL, 0 );
 			break;
@@ -914,6 +879,10 @@ int main ( int argc, char * argv[] )
 			bigtmpdir = std::string( optarg );
 			break;
 
+		case 'R':
+			readahead = true;
+			break;
+
 		default:
 			std::cerr << "Unknwon option: " << opt << std::endl << usage << std::endl;
 			return EXIT_FAILURE;
@@ -926,7 +895,14 @@ int main ( int argc, char * argv[] )
 		return EXIT_FAILURE;
 	}
 
-	csv_aggreg aggregator( bigtmpdir, line_max );
+	int compress = ( out_compress ? output_buffer::compression_by_name( out_compress ) : output_buffer::compression_for_file( outfile ) );
+	if ( compress < 0 )
+	{
+		std::cerr << "Unsupported output compression" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	csv_aggreg aggregator( bigtmpdir, line_max, readahead );
 
 	if ( aggregator.parse_aggregate_descriptor( argv[ optind++ ] ) )
 		return EXIT_FAILURE;
@@ -940,14 +916,23 @@ int main ( int argc, char * argv[] )
 	}
 	else
 	{
+		// read the next input files in the background while aggregating the current one
+		file_prefetcher prefetcher;
+		int prefetched = optind;
+
 		for ( int i = optind ; i < argc ; ++i )
+		{
+			for ( ; prefetched < argc && prefetched <= i + prefetch_depth ; ++prefetched )
+				prefetcher.prefetch( argv[ prefetched ] );
+
 			if ( merge )
 				aggregator.merge( argv[ i ] );
 			else
 				aggregator.aggregate( argv[ i ] );
+		}
 	}
 
-	aggregator.dump_output( outfile );
+	aggregator.dump_output( outfile, compress );
 
 	return EXIT_SUCCESS;
 }
@@ -5,17 +5,139 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <errno.h>
-#ifndef NO_ZLIB
-#include <zlib.h>
-#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "csv_reader.h"
+#include "block_reader.h"
+#include "row_index.h"
+#include "cpu_features.h"
+
+// narrow utf16 code units to 8 bits, units above 0xff are converted to '?'
+// reads n units from in, writes n bytes to out ; out may alias in (inplace conversion, out <= in)
+// return the number of units converted, the caller converts the remaining ones (less than a vector)
+#ifdef CPU_DISPATCH
+TARGET_AVX512
+static size_t narrow_utf16_avx512 ( char *out, const char *in, size_t n, const bool little_endian )
+{
+	size_t i = 0;
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i lomask = _mm512_set1_epi16( 0xff );
+	const __m512i subst = _mm512_set1_epi16( '?' );
+
+	for ( ; i + 32 <= n ; i += 32 )
+	{
+		__m512i a = _mm512_loadu_si512( (const void *)( in + 2*i ) );
+		if ( ! little_endian )
+			a = _mm512_or_si512( _mm512_slli_epi16( a, 8 ), _mm512_srli_epi16( a, 8 ) );
+
+		// bit set for units <= 0xff
+		const __mmask32 ok = _mm512_cmpeq_epi16_mask( _mm512_srli_epi16( a, 8 ), zero );
+		a = _mm512_mask_blend_epi16( ok, subst, _mm512_and_si512( a, lomask ) );
+
+		_mm512_mask_cvtepi16_storeu_epi8( out + i, (__mmask32)-1, a );
+	}
+
+	return i;
+}
+
+TARGET_AVX2
+static size_t narrow_utf16_avx2 ( char *out, const char *in, size_t n, const bool little_endian )
+{
+	size_t i = 0;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lomask = _mm256_set1_epi16( 0xff );
+	const __m256i subst = _mm256_set1_epi16( '?' );
+
+	for ( ; i + 32 <= n ; i += 32 )
+	{
+		__m256i a = _mm256_loadu_si256( (const __m256i *)( in + 2*i ) );
+		__m256i b = _mm256_loadu_si256( (const __m256i *)( in + 2*i + 32 ) );
+		if ( ! little_endian )
+		{
+			a = _mm256_or_si256( _mm256_slli_epi16( a, 8 ), _mm256_srli_epi16( a, 8 ) );
+			b = _mm256_or_si256( _mm256_slli_epi16( b, 8 ), _mm256_srli_epi16( b, 8 ) );
+		}
+
+		// 0xffff for units <= 0xff
+		const __m256i oka = _mm256_cmpeq_epi16( _mm256_srli_epi16( a, 8 ), zero );
+		const __m256i okb = _mm256_cmpeq_epi16( _mm256_srli_epi16( b, 8 ), zero );
+		a = _mm256_blendv_epi8( subst, _mm256_and_si256( a, lomask ), oka );
+		b = _mm256_blendv_epi8( subst, _mm256_and_si256( b, lomask ), okb );
+
+		// packus works on 128 bits lanes, restore the order of the 64 bits quarters
+		const __m256i r = _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xd8 );
+		_mm256_storeu_si256( (__m256i *)( out + i ), r );
+	}
+
+	return i;
+}
+
+TARGET_SSE2
+static size_t narrow_utf16_sse2 ( char *out, const char *in, size_t n, const bool little_endian )
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lomask = _mm_set1_epi16( 0xff );
+	const __m128i subst = _mm_set1_epi16( '?' );
+
+	for ( ; i + 16 <= n ; i += 16 )
+	{
+		__m128i a = _mm_loadu_si128( (const __m128i *)( in + 2*i ) );
+		__m128i b = _mm_loadu_si128( (const __m128i *)( in + 2*i + 16 ) );
+		if ( ! little_endian )
+		{
+			a = _mm_or_si128( _mm_slli_epi16( a, 8 ), _mm_srli_epi16( a, 8 ) );
+			b = _mm_or_si128( _mm_slli_epi16( b, 8 ), _mm_srli_epi16( b, 8 ) );
+		}
+
+		// 0xffff for units <= 0xff
+		const __m128i oka = _mm_cmpeq_epi16( _mm_srli_epi16( a, 8 ), zero );
+		const __m128i okb = _mm_cmpeq_epi16( _mm_srli_epi16( b, 8 ), zero );
+		a = _mm_or_si128( _mm_and_si128( oka, _mm_and_si128( a, lomask ) ), _mm_andnot_si128( oka, subst ) );
+		b = _mm_or_si128( _mm_and_si128( okb, _mm_and_si128( b, lomask ) ), _mm_andnot_si128( okb, subst ) );
+
+		_mm_storeu_si128( (__m128i *)( out + i ), _mm_packus_epi16( a, b ) );
+	}
+
+	return i;
+}
+#endif
+
+static size_t narrow_utf16 ( char *out, const char *in, size_t n, const bool little_endian )
+{
+#ifdef CPU_DISPATCH
+	switch ( cpu_best_level() )
+	{
+	case CPU_AVX512:
+		return narrow_utf16_avx512( out, in, n, little_endian );
+	case CPU_AVX2:
+		return narrow_utf16_avx2( out, in, n, little_endian );
+	case CPU_SSE2:
+		return narrow_utf16_sse2( out, in, n, little_endian );
+	default:
+		break;
+	}
+#else
+	(void)out;
+	(void)in;
+	(void)n;
+	(void)little_endian;
+#endif
+	return 0;
+}
 
 // wraps an istream, provide an efficient interface to read lines
 // skips UTF-8 BOM
 // interprets UTF-16 BOMs, return iso codepoints - out of range characters are converted to '?'
-// handles gzip compressed inputs
+// handles gzip, zstd and lz4 compressed inputs, decompressed by background threads
+// regular files are mmapped whole, lines are returned as pointers into the mapping
+// in readahead mode, uncompressed inputs are read by a background thread instead (no mmap)
 class line_reader
 {
 private:
@@ -24,18 +146,38 @@ private:
 	bool badfile;
 
 	// maximum line length
-	unsigned buf_cur;
-	unsigned buf_end;
-	unsigned buf_size;
+	size_t buf_cur;
+	size_t buf_end;
+	size_t buf_size;
 	char *buf;
-
-#ifndef NO_ZLIB
-	unsigned zbuf_cur;
-	unsigned zbuf_end;
-	unsigned zbuf_size;
-	char *zbuf;
-	z_stream zstream;
-#endif
+	// offset of buf[ 0 ] in the (decompressed) input stream
+	uint64_t buf_offset;
+
+	// file mapping (buf == map_base), NULL when reading from a stream
+	char *map_base;
+	size_t map_size;
+	// descriptor of the mapped file, kept open to copy the file data without going through the mapping (see mapped_input)
+	int map_fd;
+	// pages before this offset have been released with MADV_DONTNEED
+	size_t map_dropped;
+
+	// granularity of the MADV_DONTNEED calls behind the read cursor
+	static const size_t map_drop_chunk = 16*1024*1024;
+
+	// stream offsets of the data already searched for quotes (see quote_free), the data in [quote_free_begin, quote_checked_end) has none
+	uint64_t quote_free_begin;
+	uint64_t quote_checked_end;
+
+	// the input is searched for quotes by chunks of this size, small enough to stay in cache until the lines are parsed
+	static const size_t quote_scan_chunk = 64*1024;
+
+	// decompressed blocks (compressed input, or any input in readahead mode), NULL for direct reads
+	// buf points inside the current block, the unread end of the previous block is copied in its headroom
+	block_reader *blocks;
+	int blocks_mode;
+	size_t blocks_headroom;
+	// odd trailing byte of the last block, not converted yet (utf16 input)
+	int blocks_carry;
 
 	// bitmask
 	enum {
@@ -56,6 +198,11 @@ private:
 			if ( input_filter & INPUT_FILTER_UTF16LE )
 				high = 1, low = 0;
 
+			// vectorized bulk, the loop below converts the tail
+			const size_t done = narrow_utf16( buf + off_out, buf + off_in, ( off_end - off_in ) / 2, high == 1 );
+			off_in += 2 * done;
+			off_out += done;
+
 			while ( off_in < off_end )
 			{
 				if ( buf[ off_in + high ] )
@@ -80,6 +227,15 @@ private:
 	// convert utf16 according to input_filter
 	void refill_buffer ( )
 	{
+		if ( map_base )
+			return;
+
+		if ( blocks )
+		{
+			refill_block();
+			return;
+		}
+
 		if ( buf_cur > 0 )
 		{
 			if ( buf_end < buf_cur )
@@ -87,70 +243,20 @@ private:
 
 			memmove( buf, buf + buf_cur, buf_end - buf_cur );
 			buf_end -= buf_cur;
+			buf_offset += buf_cur;
 			buf_cur = 0;
 		}
 
 		if ( buf_end < buf_size )
 		{
-			unsigned toread = buf_size - buf_end;
-			unsigned old_end = buf_end;
+			size_t toread = buf_size - buf_end;
+			size_t old_end = buf_end;
 			if ( input_filter & (INPUT_FILTER_UTF16BE | INPUT_FILTER_UTF16LE) )
 				toread -= toread & 1;
 
 			if ( toread == 0 )
 				return;
 
-#ifndef NO_ZLIB
-			if (zbuf) {
-				// shift & refill compressed data if available
-				if ( zbuf_cur > zbuf_size / 2 )
-				{
-					if ( zbuf_end < zbuf_cur )
-						zbuf_end = zbuf_cur;
-					memmove( zbuf, zbuf + zbuf_cur, zbuf_end - zbuf_cur );
-					zbuf_end -= zbuf_cur;
-					zbuf_cur = 0;
-				}
-
-				if ( zbuf_size > zbuf_end )
-				{
-					input->read( zbuf + zbuf_end, zbuf_size - zbuf_end);
-					zbuf_end += input->gcount();
-				}
-
-				// decompress into buf
-				int ret;
-				zstream.next_out = (Bytef *)buf + buf_end;
-				zstream.avail_out = toread;
-				zstream.next_in = (Bytef *)zbuf + zbuf_cur;
-				zstream.avail_in = zbuf_end - zbuf_cur;
-				ret = inflate( &zstream, Z_NO_FLUSH );
-				if ( ret == Z_OK || ret == Z_STREAM_END )
-				{
-					zbuf_cur = (char *)zstream.next_in - zbuf;
-					buf_end = (char *)zstream.next_out - buf;
-				}
-
-				if ( ret != Z_OK )
-				{
-					if ( ret == Z_STREAM_END )
-					{
-						if ( zbuf_cur != zbuf_end )
-							std::cerr << "inflate: trailing data (" << (zbuf_end - zbuf_cur) << " bytes)" << std::endl;
-					} else
-						std::cerr << "inflate: " << zstream.msg << std::endl;
-
-					inflateEnd( &zstream );
-					delete[] zbuf;
-					zbuf = NULL;
-				}
-
-				if ( input_filter )
-					buf_end = filter_input( old_end, buf_end );
-
-				return;
-			}
-#endif
 
 			input->read( buf + buf_end, toread );
 			buf_end += input->gcount();
@@ -162,38 +268,152 @@ private:
 		}
 	}
 
-#ifndef NO_ZLIB
-	void init_zstream(void)
+	// switch buf to the next decompressed block, the unread data is moved in the block headroom
+	void refill_block ( )
 	{
-		zbuf = buf;
-		zbuf_cur = buf_cur;
-		zbuf_end = buf_end;
-		zbuf_size = buf_size;
+		if ( buf_end < buf_cur )
+			buf_end = buf_cur;
 
-		buf = new char[buf_size];
-		buf_cur = buf_end = 0;
+		size_t tail = buf_end - buf_cur;
+		char *data;
+		size_t len;
 
-		int ret;
-		zstream.zalloc = Z_NULL;
-		zstream.zfree = Z_NULL;
-		zstream.opaque = Z_NULL;
-		zstream.avail_in = zbuf_end - zbuf_cur;
-		zstream.next_in = (Bytef *)zbuf + zbuf_cur;
+		if ( ! blocks->next( &data, &len ) )
+		{
+			// end of stream, keep the unread data
+			buf += buf_cur;
+			buf_end -= buf_cur;
+			buf_offset += buf_cur;
+			buf_cur = 0;
 
-		ret = inflateInit2( &zstream, 32|15 );
+			return;
+		}
 
-		if (ret != Z_OK)
+		size_t head = tail + ( blocks_carry != -1 ? 1 : 0 );
+		char *nbuf = data - head;
+		if ( tail > 0 )
+			memcpy( nbuf, buf + buf_cur, tail );
+		if ( blocks_carry != -1 )
 		{
-			std::cerr << "inflateInit: " << zstream.msg << std::endl;
-			badfile = true;
-			return;
+			nbuf[ tail ] = blocks_carry;
+			blocks_carry = -1;
 		}
 
-		zbuf_cur = (char *)zstream.next_in - zbuf;
+		buf_offset += buf_cur;
+		buf = nbuf;
+		buf_cur = 0;
+		buf_end = head + len;
+
+		if ( input_filter )
+		{
+			if ( ( buf_end - tail ) & 1 )
+				blocks_carry = (unsigned char)buf[ --buf_end ];
+			buf_end = filter_input( tail, buf_end );
+		}
+	}
+
+	// start reading/decompressing the input from background threads, data already read is in buf
+	void init_blocks ( int mode )
+	{
+		blocks_headroom = buf_size;
+		start_blocks( mode, buf + buf_cur, buf_end - buf_cur, NULL );
+
+		delete[] buf;
+		buf = NULL;
+		buf_cur = buf_end = 0;
 
 		refill_buffer();
 	}
-#endif
+
+	// create the block reader, prefix holds data already read from input
+	void start_blocks ( int mode, const char *prefix, size_t prefix_len, const block_reader::inflate_point *resume )
+	{
+		long ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+		unsigned nthreads = ( ncpu < 1 ? 1 : ncpu > 8 ? 8 : ncpu );
+		size_t block_size = 4*1024*1024;
+		if ( block_size < 2*blocks_headroom )
+			block_size = 2*blocks_headroom;
+
+		blocks_mode = mode;
+		// one more byte for the utf16 carry
+		blocks = new block_reader( input, prefix, prefix_len, mode, blocks_headroom + 1, block_size, nthreads, resume );
+		if ( blocks->failed() )
+			badfile = true;
+	}
+
+	void report_long_line ( ) const
+	{
+		std::string sample( buf + buf_cur, (buf_end - buf_cur > 64 ? 64 : buf_end - buf_cur) );
+		std::cerr << "Line too long, near '" << sample << "'" << std::endl;
+	}
+
+	// return true if more data may be read from the input
+	bool more_input ( ) const
+	{
+		if ( blocks )
+			return !blocks->eof();
+
+		return input->good();
+	}
+
+	// try to mmap a regular file as a whole, and use it as buf
+	// return false (and leave everything untouched) if the file is not suitable: not a regular file, empty, compressed or utf16
+	bool map_file ( const char *filename )
+	{
+		int fd = open( filename, O_RDONLY );
+		if ( fd == -1 )
+			return false;
+
+		struct stat st;
+		if ( fstat( fd, &st ) || !S_ISREG( st.st_mode ) || st.st_size <= 0 )
+		{
+			close( fd );
+			return false;
+		}
+
+		// writable private mapping: callers may modify the returned lines in place (copy on write)
+		// no swap reservation, or files larger than ram + swap could not be mapped
+		void *ptr = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0 );
+		if ( ptr == MAP_FAILED )
+		{
+			close( fd );
+			return false;
+		}
+
+		const unsigned char *magic = (const unsigned char *)ptr;
+		if ( block_reader::compression_mode( (const char *)ptr, st.st_size ) != block_reader::MODE_RAW || ( st.st_size >= 2 && (
+				( magic[0] == 0xfe && magic[1] == 0xff ) ||
+				( magic[0] == 0xff && magic[1] == 0xfe ) ) ) )
+		{
+			// needs the stream path for decompression / transcoding
+			munmap( ptr, st.st_size );
+			close( fd );
+			return false;
+		}
+
+		madvise( ptr, st.st_size, MADV_SEQUENTIAL );
+
+		map_base = (char *)ptr;
+		map_size = st.st_size;
+		map_fd = fd;
+		map_dropped = 0;
+
+		buf = map_base;
+		buf_size = buf_end = map_size;
+
+		return true;
+	}
+
+	// release the mapping pages well behind the read cursor
+	void drop_mapped_pages ( )
+	{
+		if ( buf_cur < map_dropped + 2*map_drop_chunk )
+			return;
+
+		size_t end = ( buf_cur - map_drop_chunk ) & ~(size_t)( sysconf( _SC_PAGESIZE ) - 1 );
+		madvise( map_base + map_dropped, end - map_dropped, MADV_DONTNEED );
+		map_dropped = end;
+	}
 
 public:
 	bool failed_to_open ( ) const
@@ -204,7 +424,10 @@ public:
 	// return true if no more data is available from input
 	bool eos ( ) const
 	{
-		if ( input->good() )
+		if ( map_base )
+			return buf_cur >= buf_end;
+
+		if ( more_input() )
 			return false;
 
 		if ( buf_cur < buf_end )
@@ -213,23 +436,39 @@ public:
 		return true;
 	}
 
-	explicit line_reader ( const char *filename, const unsigned line_max = 64*1024 ) :
+	explicit line_reader ( const char *filename, const unsigned line_max = 64*1024, const bool readahead = false ) :
+		input(NULL),
 		should_delete_input(false),
 		badfile(false),
 		buf_cur(0),
 		buf_end(0),
 		buf_size(line_max),
-#ifndef NO_ZLIB
-		zbuf(NULL),
-#endif
+		buf(NULL),
+		buf_offset(0),
+		map_base(NULL),
+		map_size(0),
+		map_fd(-1),
+		map_dropped(0),
+		quote_free_begin(0),
+		quote_checked_end(0),
+		blocks(NULL),
+		blocks_mode(block_reader::MODE_RAW),
+		blocks_headroom(0),
+		blocks_carry(-1),
 		input_filter(0)
 	{
-		buf = new char[buf_size];
-
 		if ( filename && filename[ 0 ] == '-' && filename[ 1 ] == 0 )
 		{
 			input = &std::cin;
 		}
+		else if ( filename && !readahead && map_file( filename ) )
+		{
+			if ( buf_end >= 3 && buf[0] == '\xef' && buf[1] == '\xbb' && buf[2] == '\xbf' )
+				// discard utf-8 BOM
+				buf_cur += 3;
+
+			return;
+		}
 		else if ( filename )
 		{
 			should_delete_input = true;
@@ -252,14 +491,15 @@ public:
 			input = &std::cin;
 		}
 
+		buf = new char[buf_size];
+
 		input->read( buf, (buf_size > 4096 ? buf_size/16 : buf_size) );
 		buf_end = input->gcount();
 
-#ifndef NO_ZLIB
-		if ( buf_end >= 2 && buf[0] == 0x1f && buf[1] == (char)0x8b )
-			// zlib header
-			init_zstream();
-#endif
+		// gzip/zstd/lz4 magic
+		int mode = block_reader::compression_mode( buf, buf_end );
+		if ( mode != block_reader::MODE_RAW || readahead )
+			init_blocks( mode );
 
 		if ( buf_end >= 3 && buf[0] == '\xef' && buf[1] == '\xbb' && buf[2] == '\xbf' )
 		{
@@ -284,14 +524,19 @@ public:
 
 	~line_reader ( )
 	{
+		// stop the decompression threads before closing their input
+		if ( blocks )
+			delete blocks;
+		else if ( map_base )
+		{
+			munmap( map_base, map_size );
+			close( map_fd );
+		}
+		else
+			delete[] buf;
+
 		if ( should_delete_input )
 			delete input;
-
-		delete[] buf;
-#ifndef NO_ZLIB
-		if ( zbuf )
-			delete[] zbuf;
-#endif
 	}
 
 	// read one line from input, starting at buf_cur
@@ -309,6 +554,53 @@ public:
 		if ( buf_cur < buf_end )
 			nl = (char*)memchr( (void*)(buf + buf_cur), '\n', buf_end - buf_cur );
 
+		if ( map_base )
+		{
+			// whole file is in buf, pointers stay valid until the reader is destroyed
+			if ( buf_cur >= buf_end )
+			{
+				*line_start = NULL;
+				*line_length = 0;
+
+				return false;
+			}
+
+			// eof is considered as a newline
+			const size_t length = ( nl ? (size_t)( nl + 1 - ( buf + buf_cur ) ) : buf_end - buf_cur );
+
+			// line lengths are unsigned
+			if ( length >= UINT_MAX )
+			{
+				*line_start = NULL;
+				*line_length = 0;
+
+				report_long_line();
+				buf_cur += length;
+
+				return false;
+			}
+
+			*line_start = buf + buf_cur;
+			*line_length = length;
+
+			buf_cur += length;
+			drop_mapped_pages();
+
+			return true;
+		}
+
+		// blocks may hold lines longer than line_max: enforce the same limit as the direct read buffer
+		if ( blocks && ( nl ? (size_t)( nl + 1 - ( buf + buf_cur ) ) : ( more_input() ? 0 : buf_end - buf_cur ) ) > blocks_headroom )
+		{
+			*line_start = NULL;
+			*line_length = 0;
+
+			report_long_line();
+			buf_cur = ( nl ? nl + 1 - buf : buf_end );
+
+			return false;
+		}
+
 		// newline found ?
 		if ( nl )
 		{
@@ -323,7 +615,8 @@ public:
 		}
 
 		// slide existing buffer, read more from input, and retry
-		if ( buf_cur > 0 )
+		// (a block headroom can only hold line_max bytes, a block without newline still needs a refill to detect eof)
+		if ( ( buf_cur > 0 || ( blocks && more_input() ) ) && ( !blocks || buf_end - buf_cur <= blocks_headroom ) )
 		{
 			refill_buffer();
 
@@ -331,7 +624,7 @@ public:
 		}
 
 		// end of file ?
-		if ( !input->good() )
+		if ( !more_input() )
 		{
 			if ( buf_cur < buf_end )
 			{
@@ -354,21 +647,125 @@ public:
 		*line_start = NULL;
 		*line_length = 0;
 
-		std::string sample( buf, (buf_end > 64 ? 64 : buf_end) );
-		std::cerr << "Line too long, near '" << sample << "'" << std::endl;
+		report_long_line();
 
 		// slide buffer anyway, to avoid infinite loop in badly written clients
-		buf_cur = 0;
-		buf_end = 0;
+		buf_cur = buf_end;
 		refill_buffer();
 
 		return false;
 	}
 
+	// return the offset in the (decompressed) input stream of the next line to be returned by read_line
+	uint64_t tell ( ) const
+	{
+		return buf_offset + buf_cur;
+	}
+
+	// move the read cursor to an arbitrary offset, only possible for mapped inputs
+	// the next read_line will return the data starting at this offset
+	bool seek ( uint64_t off )
+	{
+		if ( !map_base || off > map_size )
+			return false;
+
+		buf_cur = off;
+		map_dropped = off & ~(uint64_t)( sysconf( _SC_PAGESIZE ) - 1 );
+		quote_free_begin = quote_checked_end = off;
+
+		return true;
+	}
+
+	// return true if the whole input is mapped in memory
+	// in this case, pointers returned by read_line stay valid until the reader is destroyed, and successive lines are contiguous
+	bool is_mapped ( ) const
+	{
+		return map_base != NULL;
+	}
+
+	// get the descriptor, mapping and size of a mapped input
+	bool mapped_input ( int *fd, const char* *data, uint64_t *size ) const
+	{
+		if ( !map_base )
+			return false;
+
+		*fd = map_fd;
+		*data = map_base;
+		*size = map_size;
+
+		return true;
+	}
+
+	// restart inflating a gzip file at a resume point (in_off / point in the compressed file, out_off in the uncompressed stream),
+	// then skip data up to the uncompressed offset off
+	// only possible for gzip files (not stdin) without utf16 transcoding
+	bool seek_inflate ( uint64_t in_off, const block_reader::inflate_point &point, uint64_t out_off, uint64_t off )
+	{
+		if ( !blocks || !should_delete_input || input_filter || off < out_off ||
+				( blocks_mode != block_reader::MODE_GZIP && blocks_mode != block_reader::MODE_BGZF ) )
+			return false;
+
+		// the input is now used by this thread only
+		delete blocks;
+		blocks = NULL;
+
+		input->clear();
+		input->seekg( in_off - ( point.bits ? 1 : 0 ) );
+
+		start_blocks( block_reader::MODE_GZIP, NULL, 0, &point );
+		buf = NULL;
+		buf_cur = buf_end = 0;
+		buf_offset = out_off;
+		blocks_carry = -1;
+		refill_buffer();
+
+		while ( buf_offset + buf_end < off )
+		{
+			if ( !more_input() )
+				return false;
+
+			buf_cur = buf_end;
+			refill_buffer();
+		}
+
+		buf_cur = off - buf_offset;
+		quote_free_begin = quote_checked_end = off;
+
+		return true;
+	}
+
+	// return true if the line returned by the last read_line contains no quot character
+	// the buffered data is searched ahead of the line, so that the following lines are answered without looking at them again
+	// a chunk with a quote anywhere makes all its lines not quote free
+	bool quote_free ( const char *line, size_t length, const char quot )
+	{
+		const uint64_t start = buf_offset + ( line - buf );
+		const uint64_t end = start + length;
+
+		if ( start >= quote_checked_end )
+			quote_free_begin = quote_checked_end = start;
+
+		while ( end > quote_checked_end )
+		{
+			const size_t from = quote_checked_end - buf_offset;
+			size_t to = buf_end;
+			if ( to - from > quote_scan_chunk )
+				to = from + quote_scan_chunk;
+
+			if ( memchr( buf + from, quot, to - from ) )
+				quote_free_begin = buf_offset + to;
+
+			quote_checked_end = buf_offset + to;
+		}
+
+		return start >= quote_free_begin;
+	}
+
 	// read raw data (dont mix with read_line)
 	void read ( char* *ptr, unsigned *len )
 	{
-		if ( *len > ( buf_end - buf_cur ) )
+		// a block headroom can only hold line_max bytes: return the unread data of a block before switching to the next
+		if ( *len > ( buf_end - buf_cur ) && ( !blocks || buf_end - buf_cur <= blocks_headroom ) )
 			refill_buffer();
 
 		if ( *len > ( buf_end - buf_cur ) )
@@ -383,6 +780,124 @@ private:
 	line_reader& operator=( const line_reader& );
 };
 
+// compute the bitmaps of the separator and quote characters in nblocks blocks of 64 bytes
+// bit i of masks[ 2*k ] is set if p[ 64*k + i ] == sep, bit i of masks[ 2*k + 1 ] if it is quot
+// SEP and QUOT are the characters known at compile time, or DELIM_ANY to use the sep and quot arguments
+template< int SEP, int QUOT >
+static void scan_blocks_generic ( const char *p, const unsigned nblocks, const char rt_sep, const char rt_quot, uint64_t *masks )
+{
+	const char sep = ( SEP == csv_reader::DELIM_ANY ? rt_sep : (char)SEP );
+	const char quot = ( QUOT == csv_reader::DELIM_ANY ? rt_quot : (char)QUOT );
+
+	for ( unsigned k = 0 ; k < nblocks ; ++k, p += 64 )
+	{
+		uint64_t s = 0, q = 0;
+
+		for ( unsigned i = 0 ; i < 64 ; ++i )
+		{
+			s |= (uint64_t)( p[ i ] == sep ) << i;
+			q |= (uint64_t)( p[ i ] == quot ) << i;
+		}
+
+		masks[ 2*k ] = s;
+		masks[ 2*k + 1 ] = q;
+	}
+}
+
+#ifdef CPU_DISPATCH
+template< int SEP, int QUOT >
+TARGET_AVX512
+static void scan_blocks_avx512 ( const char *p, const unsigned nblocks, const char rt_sep, const char rt_quot, uint64_t *masks )
+{
+	const __m512i vsep = _mm512_set1_epi8( SEP == csv_reader::DELIM_ANY ? rt_sep : (char)SEP );
+	const __m512i vquot = _mm512_set1_epi8( QUOT == csv_reader::DELIM_ANY ? rt_quot : (char)QUOT );
+
+	for ( unsigned k = 0 ; k < nblocks ; ++k, p += 64 )
+	{
+		const __m512i v = _mm512_loadu_si512( (const void *)p );
+
+		masks[ 2*k ] = _mm512_cmpeq_epi8_mask( v, vsep );
+		masks[ 2*k + 1 ] = _mm512_cmpeq_epi8_mask( v, vquot );
+	}
+}
+
+template< int SEP, int QUOT >
+TARGET_AVX2
+static void scan_blocks_avx2 ( const char *p, const unsigned nblocks, const char rt_sep, const char rt_quot, uint64_t *masks )
+{
+	const __m256i vsep = _mm256_set1_epi8( SEP == csv_reader::DELIM_ANY ? rt_sep : (char)SEP );
+	const __m256i vquot = _mm256_set1_epi8( QUOT == csv_reader::DELIM_ANY ? rt_quot : (char)QUOT );
+
+	for ( unsigned k = 0 ; k < nblocks ; ++k, p += 64 )
+	{
+		const __m256i lo = _mm256_loadu_si256( (const __m256i *)p );
+		const __m256i hi = _mm256_loadu_si256( (const __m256i *)( p + 32 ) );
+
+		masks[ 2*k ] = (uint64_t)(uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, vsep ) ) |
+			( (uint64_t)(uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, vsep ) ) << 32 );
+		masks[ 2*k + 1 ] = (uint64_t)(uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, vquot ) ) |
+			( (uint64_t)(uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, vquot ) ) << 32 );
+	}
+}
+
+template< int SEP, int QUOT >
+TARGET_SSE2
+static void scan_blocks_sse2 ( const char *p, const unsigned nblocks, const char rt_sep, const char rt_quot, uint64_t *masks )
+{
+	const __m128i vsep = _mm_set1_epi8( SEP == csv_reader::DELIM_ANY ? rt_sep : (char)SEP );
+	const __m128i vquot = _mm_set1_epi8( QUOT == csv_reader::DELIM_ANY ? rt_quot : (char)QUOT );
+
+	for ( unsigned k = 0 ; k < nblocks ; ++k, p += 64 )
+	{
+		uint64_t s = 0, q = 0;
+
+		for ( unsigned i = 0 ; i < 64 ; i += 16 )
+		{
+			const __m128i v = _mm_loadu_si128( (const __m128i *)( p + i ) );
+			s |= (uint64_t)(uint16_t)_mm_movemask_epi8( _mm_cmpeq_epi8( v, vsep ) ) << i;
+			q |= (uint64_t)(uint16_t)_mm_movemask_epi8( _mm_cmpeq_epi8( v, vquot ) ) << i;
+		}
+
+		masks[ 2*k ] = s;
+		masks[ 2*k + 1 ] = q;
+	}
+}
+#endif
+
+// return the scan_blocks version for the cpu
+template< int SEP, int QUOT >
+static csv_reader::scan_blocks_fn select_scan_blocks ( )
+{
+#ifdef CPU_DISPATCH
+	switch ( cpu_best_level() )
+	{
+	case CPU_AVX512:
+		return &scan_blocks_avx512< SEP, QUOT >;
+	case CPU_AVX2:
+		return &scan_blocks_avx2< SEP, QUOT >;
+	case CPU_SSE2:
+		return &scan_blocks_sse2< SEP, QUOT >;
+	default:
+		break;
+	}
+#endif
+	return &scan_blocks_generic< SEP, QUOT >;
+}
+
+// bit i of the result is set if an odd number of bits are set in x[0..i]
+// applied to a quote bitmap, this gives the bytes inside quotes (opening quote included, closing quote excluded)
+static inline uint64_t prefix_xor ( uint64_t x )
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+
+	return x;
+}
+
 // set cur_line_length from cur_line_length_nl, trim \r\n
 void csv_reader::trim_newlines ( )
 {
@@ -395,11 +910,256 @@ void csv_reader::trim_newlines ( )
 		cur_line_length--;
 }
 
+// split the current line in fields using separator/quote bitmaps, fill field_ends
+// return false if the line must go through the scalar parser (multi-line field, quote in an unquoted field, syntax error)
+//
+// the line is processed by blocks of 64 bytes ; inside a block, the quoted areas are found with a prefix xor of the quote bitmap,
+// and the field boundaries are the separators outside of quotes.
+// the quotes must follow the rules of read_csv_field: a field starting with a quote ends with a quote followed by a separator,
+// a quote in the middle of a quoted field must be doubled. Anything else is left to the scalar parser.
+//
+// the function is instantiated for the usual separator/quote pairs, so that the compares use constant vectors
+// (see select_scan_fields), DELIM_ANY is the generic version
+template< int SEP, int QUOT >
+bool csv_reader::scan_fields ( )
+{
+	const char sep = ( SEP == DELIM_ANY ? this->sep : (char)SEP );
+	const char quot = ( QUOT == DELIM_ANY ? this->quot : (char)QUOT );
+
+	field_ends.clear();
+	field_idx = 0;
+	scan_truncated = false;
+	bool rest_checked = false;
+
+	if ( sep == quot )
+		return false;
+
+	// state carried from the previous block, in bit 0 (or all bits for in_quote)
+	uint64_t in_quote = 0;		// previous byte is inside a quoted field
+	uint64_t prev_bound = 1;	// previous byte is a field boundary (or start of line)
+	uint64_t prev_quot = 0;		// previous byte is a quote
+	uint64_t prev_close = 0;	// previous byte is a closing quote
+
+	// bitmaps of the next scan_batch blocks
+	uint64_t masks[ 2*scan_batch ];
+
+	for ( unsigned off = 0 ; off < cur_line_length ; off += 64 )
+	{
+		const unsigned blk = ( off / 64 ) % scan_batch;
+		const unsigned left = cur_line_length - off;
+
+		if ( blk == 0 )
+			load_masks( off, masks );
+
+		uint64_t s = masks[ 2*blk ];
+		uint64_t q = masks[ 2*blk + 1 ];
+		uint64_t valid = ~0ULL;
+
+		if ( left < 64 )
+		{
+			valid = ( 1ULL << left ) - 1;
+			s &= valid;
+			q &= valid;
+		}
+
+		uint64_t bounds = s;
+
+		if ( q | in_quote | prev_close )
+		{
+			const uint64_t inq = prefix_xor( q ) ^ in_quote;
+			const uint64_t inq_prev = ( inq << 1 ) | ( in_quote & 1 );
+			const uint64_t opening = q & ~inq_prev;
+			const uint64_t closing = q & inq_prev;
+
+			bounds = s & ~inq;
+
+			// an opening quote must start a field, or be the 2nd half of an escaped quote
+			const uint64_t field_start = ( bounds << 1 ) | prev_bound;
+			const uint64_t after_quot = ( q << 1 ) | prev_quot;
+			if ( opening & ~field_start & ~after_quot )
+				return false;
+
+			// a closing quote must be followed by a quote, a separator, or the end of the line
+			const uint64_t after_close = ( closing << 1 ) | prev_close;
+			if ( after_close & ~( q | s ) & valid )
+				return false;
+
+			in_quote = ( inq >> 63 ) ? ~0ULL : 0;
+			prev_quot = q >> 63;
+			prev_close = closing >> 63;
+		}
+		else
+			prev_quot = 0;
+
+		prev_bound = bounds >> 63;
+
+		while ( bounds )
+		{
+			field_ends.push_back( off + __builtin_ctzll( bounds ) );
+			bounds &= bounds - 1;
+		}
+
+		if ( max_fields && field_ends.size() >= max_fields && ! rest_checked )
+		{
+			// enough fields: if the rest of the line has no quote, the row ends with the line, no need to look further
+			const unsigned rest = field_ends[ max_fields - 1 ] + 1;
+			rest_checked = true;
+
+			if ( row_quote_free || ! memchr( cur_line + rest, quot, cur_line_length - rest ) )
+			{
+				field_ends.resize( max_fields );
+				scan_truncated = true;
+
+				return true;
+			}
+		}
+	}
+
+	// unclosed quote: the field spans multiple lines
+	if ( in_quote )
+		return false;
+
+	field_ends.push_back( cur_line_length );
+
+	return true;
+}
+
+// fill masks with the separator and quote bitmaps of the next scan_batch blocks of the current line, starting at off
+inline void csv_reader::load_masks ( const unsigned off, uint64_t *masks ) const
+{
+	const unsigned left = cur_line_length - off;
+	const unsigned full = std::min( left / 64, (unsigned)scan_batch );
+
+	if ( full )
+		scan_blocks( cur_line + off, full, sep, quot, masks );
+
+	if ( full < scan_batch && left % 64 )
+	{
+		// last partial block: do not read past the end of the line
+		char tmp[ 64 ];
+
+		memcpy( tmp, cur_line + off + 64*full, left % 64 );
+		memset( tmp + left % 64, 0, 64 - left % 64 );
+		scan_blocks( tmp, 1, sep, quot, masks + 2*full );
+	}
+}
+
+// pick the scan_fields() instance matching sep and quot, and the scan_blocks kernel for the cpu
+void csv_reader::select_scan_fields ( )
+{
+	if ( quot == '"' && sep == ',' )
+	{
+		scan_fields_fn = &csv_reader::scan_fields< ',', '"' >;
+		scan_blocks = select_scan_blocks< ',', '"' >();
+	}
+	else if ( quot == '"' && sep == ';' )
+	{
+		scan_fields_fn = &csv_reader::scan_fields< ';', '"' >;
+		scan_blocks = select_scan_blocks< ';', '"' >();
+	}
+	else if ( quot == '"' && sep == '\t' )
+	{
+		scan_fields_fn = &csv_reader::scan_fields< '\t', '"' >;
+		scan_blocks = select_scan_blocks< '\t', '"' >();
+	}
+	else if ( quot == '"' && sep == '|' )
+	{
+		scan_fields_fn = &csv_reader::scan_fields< '|', '"' >;
+		scan_blocks = select_scan_blocks< '|', '"' >();
+	}
+	else
+	{
+		scan_fields_fn = &csv_reader::scan_fields< DELIM_ANY, DELIM_ANY >;
+		scan_blocks = select_scan_blocks< DELIM_ANY, DELIM_ANY >();
+	}
+}
+
 bool csv_reader::failed_to_open ( ) const
 {
 	return input_lines->failed_to_open();
 }
 
+// return true if the input is a regular file mapped in memory (see line_reader)
+bool csv_reader::is_mapped ( ) const
+{
+	return input_lines->is_mapped();
+}
+
+bool csv_reader::mapped_input ( int *fd, const char* *data, uint64_t *size ) const
+{
+	return input_lines->mapped_input( fd, data, size );
+}
+
+// return the input offset of the current row (valid after fetch_line())
+uint64_t csv_reader::row_offset ( ) const
+{
+	return cur_row_offset;
+}
+
+// return the input offset of the next row to be returned by fetch_line()
+uint64_t csv_reader::next_row_offset ( ) const
+{
+	return input_lines->tell();
+}
+
+// move to an arbitrary offset of a mapped input, which should be a row start
+// the next fetch_line() returns the row at this offset
+bool csv_reader::seek ( uint64_t off )
+{
+	if ( ! input_lines->seek( off ) )
+		return false;
+
+	reset_row();
+
+	return true;
+}
+
+// move to a row, using a checkpoint from the input row_index
+bool csv_reader::seek ( const row_checkpoint &cp )
+{
+	if ( input_lines->is_mapped() )
+		return seek( cp.row_off );
+
+	if ( ! input_lines->seek_inflate( cp.in_off, cp.point, cp.out_off, cp.row_off ) )
+		return false;
+
+	reset_row();
+
+	return true;
+}
+
+// forget the current row after a seek
+void csv_reader::reset_row ( )
+{
+	failed = false;
+	cur_line = NULL;
+	cur_line_length = cur_line_length_nl = 0;
+	cur_field_offset = 1;
+	scan_state = SCAN_SCALAR;
+	row_quote_free = false;
+	fields_read = 0;
+	skipped_end = 0;
+	skipped_fields = 0;
+}
+
+// only the first n fields of each row will be used (0 = all fields)
+void csv_reader::set_max_fields ( unsigned n )
+{
+	max_fields = n;
+}
+
+// number of fields at the end of the current row that were skipped because of set_max_fields
+unsigned csv_reader::skipped_field_count ( ) const
+{
+	return skipped_fields;
+}
+
+// fetch_line() will return false instead of returning a row starting at or after this offset
+void csv_reader::set_row_limit ( uint64_t off )
+{
+	row_limit = off;
+}
+
 // return true if no more data is available from input_lines
 bool csv_reader::eos ( ) const
 {
@@ -419,10 +1179,14 @@ bool csv_reader::eos ( ) const
 void csv_reader::reset_cur_field_offset ( )
 {
 	cur_field_offset = 0;
+	field_idx = 0;
+	fields_read = 0;
+	skipped_end = 0;
+	skipped_fields = 0;
 }
 
 // line_max is passed to the line_reader, it is also the limit for a full csv row (that may span many lines)
-csv_reader::csv_reader ( const char *filename, const char sep, const char quot, const unsigned line_max ) :
+csv_reader::csv_reader ( const char *filename, const char sep, const char quot, const unsigned line_max, const bool readahead ) :
 	line_max(line_max),
 	line_copy(NULL),
 	failed(false),
@@ -431,9 +1195,22 @@ csv_reader::csv_reader ( const char *filename, const char sep, const char quot,
 	cur_line(NULL),
 	cur_line_length(0),
 	cur_line_length_nl(0),
-	cur_field_offset(1)
+	cur_field_offset(1),
+	cur_row_offset(0),
+	row_limit(0),
+	field_idx(0),
+	scan_state(SCAN_SCALAR),
+	scan_truncated(false),
+	row_quote_free(false),
+	max_fields(0),
+	fields_read(0),
+	skipped_end(0),
+	skipped_fields(0),
+	scratch_cur(0),
+	scratch_used(0)
 {
-	input_lines = new line_reader(filename, line_max);
+	input_lines = new line_reader(filename, line_max, readahead);
+	select_scan_fields();
 }
 
 csv_reader::~csv_reader ( )
@@ -441,9 +1218,37 @@ csv_reader::~csv_reader ( )
 	if ( line_copy )
 		delete[] line_copy;
 
+	for ( unsigned i = 0 ; i < scratch.size() ; ++i )
+		delete[] scratch[ i ].ptr;
+
 	delete input_lines;
 }
 
+// return len bytes of scratch memory, valid until the next fetch_line()
+char *csv_reader::scratch_alloc ( size_t len )
+{
+	while ( scratch_cur < scratch.size() && scratch[ scratch_cur ].size - scratch_used < len )
+	{
+		++scratch_cur;
+		scratch_used = 0;
+	}
+
+	if ( scratch_cur >= scratch.size() )
+	{
+		scratch_chunk chunk;
+		chunk.size = ( len > 64*1024 ? len : 64*1024 );
+		chunk.ptr = new char[ chunk.size ];
+		scratch.push_back( chunk );
+		scratch_cur = scratch.size() - 1;
+		scratch_used = 0;
+	}
+
+	char *ret = scratch[ scratch_cur ].ptr + scratch_used;
+	scratch_used += len;
+
+	return ret;
+}
+
 // read one line from input_lines
 // invalidates previous read_csv_field pointers
 // return false after EOF
@@ -452,9 +1257,27 @@ bool csv_reader::fetch_line ( )
 	if ( failed )
 		return false;
 
+	cur_row_offset = input_lines->tell();
+	scratch_cur = 0;
+	scratch_used = 0;
+	fields_read = 0;
+	skipped_end = 0;
+	skipped_fields = 0;
+
+	if ( row_limit && cur_row_offset >= row_limit )
+	{
+		failed = true;
+		cur_field_offset = 1;
+		cur_line_length = cur_line_length_nl = 0;
+
+		return false;
+	}
+
 	if ( input_lines->read_line( &cur_line, &cur_line_length_nl ) )
 	{
 		cur_field_offset = 0;
+		scan_state = SCAN_PENDING;
+		row_quote_free = ( sep != quot && input_lines->quote_free( cur_line, cur_line_length_nl, quot ) );
 		trim_newlines();
 
 		return true;
@@ -472,6 +1295,46 @@ bool csv_reader::fetch_line ( )
 // returns a pointer to the line start, the offset of the current field, and its length
 // the 'field_offset' returned by previous calls for the same line is still valid relative to the new 'line_start' (which may change if one field crosses a line boundary, in that case the lines are copied into an internal buffer)
 bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length )
+{
+	if ( max_fields && fields_read == max_fields && skip_fields() )
+		return false;
+
+	if ( ! parse_csv_field( line_start, field_offset, field_length ) )
+		return false;
+
+	++fields_read;
+
+	return true;
+}
+
+// skip the rest of the current row once max_fields fields are read
+// unquoted fields cannot span lines: if the rest of the line has no quote, the row ends with the current line
+// else return false, the remaining fields are parsed and returned as usual
+bool csv_reader::skip_fields ( )
+{
+	if ( failed || cur_field_offset > cur_line_length )
+		return false;
+
+	if ( ! row_quote_free && !( scan_state == SCAN_DONE && scan_truncated ) &&
+			memchr( cur_line + cur_field_offset, quot, cur_line_length - cur_field_offset ) )
+		return false;
+
+	skip_to_row_end();
+
+	return true;
+}
+
+// jump to the end of the current row, which has no quote after cur_field_offset
+void csv_reader::skip_to_row_end ( )
+{
+	// count the skipped fields, without quote they are delimited by all the separators
+	skipped_fields = 1 + std::count( cur_line + cur_field_offset, cur_line + cur_line_length, sep );
+	skipped_end = cur_line_length;
+	cur_field_offset = cur_line_length + 1;
+}
+
+// read_csv_field without the max_fields check
+bool csv_reader::parse_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length )
 {
 	if ( failed )
 		return false;
@@ -482,6 +1345,18 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 	*field_offset = cur_field_offset;
 	*line_start = cur_line;
 
+	if ( scan_state == SCAN_PENDING && cur_field_offset == 0 )
+		scan_state = ( (this->*scan_fields_fn)() ? SCAN_DONE : SCAN_SCALAR );
+
+	if ( scan_state == SCAN_DONE )
+	{
+		// field boundaries already known
+		*field_length = field_ends[ field_idx++ ] - cur_field_offset;
+		cur_field_offset += *field_length + 1;
+
+		return true;
+	}
+
 	if ( cur_field_offset == cur_line_length )
 	{
 		// line ends in a coma
@@ -552,7 +1427,10 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 		}
 
 		// no closing quote on current input_lines line
-		if ( cur_line != line_copy )
+		// mapped inputs return contiguous lines that stay valid: extend the current line in place
+		// in both cases, a row spanning many lines is limited to line_max (eg an unclosed quote)
+		const bool mapped = input_lines->is_mapped();
+		if ( !mapped && cur_line != line_copy )
 		{
 			// copy current line to internal buffer
 			if ( !line_copy )
@@ -568,7 +1446,15 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 
 		input_lines->read_line( &next_line, &next_line_length_nl );
 
-		if ( next_line && cur_line_length_nl + next_line_length_nl <= line_max )
+		if ( next_line && mapped && (size_t)cur_line_length_nl + next_line_length_nl <= line_max )
+		{
+			*field_length = cur_line_length_nl - cur_field_offset;
+
+			cur_line_length_nl += next_line_length_nl;
+
+			trim_newlines();
+		}
+		else if ( next_line && cur_line_length_nl + next_line_length_nl <= line_max )
 		{
 			// next line fits in internal buffer: append
 			memcpy( line_copy + cur_line_length_nl, next_line, next_line_length_nl );
@@ -598,6 +1484,158 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 	}
 }
 
+// read all the remaining fields of the current line, same as calling read_csv_field() until it returns false
+// returns the number of fields read
+unsigned csv_reader::read_row ( char* *line_start, std::vector<unsigned> *offsets, std::vector<unsigned> *lengths, unsigned *row_end )
+{
+	*line_start = cur_line;
+
+	if ( failed || cur_field_offset > cur_line_length )
+	{
+		offsets->clear();
+		lengths->clear();
+		if ( row_end )
+			*row_end = 0;
+
+		return 0;
+	}
+
+	if ( scan_state == SCAN_PENDING && cur_field_offset == 0 )
+		scan_state = ( (this->*scan_fields_fn)() ? SCAN_DONE : SCAN_SCALAR );
+
+	if ( scan_state == SCAN_DONE )
+	{
+		// field boundaries already known: convert them all at once
+		// field_ends stops at max_fields if the rest of the line can be skipped
+		const unsigned n = field_ends.size() - field_idx;
+		offsets->resize( n );
+		lengths->resize( n );
+
+		if ( n )
+		{
+			unsigned *po = &(*offsets)[ 0 ];
+			unsigned *pl = &(*lengths)[ 0 ];
+			const unsigned *pe = &field_ends[ field_idx ];
+			unsigned off = cur_field_offset;
+			for ( unsigned i = 0 ; i < n ; ++i )
+			{
+				po[ i ] = off;
+				pl[ i ] = pe[ i ] - off;
+				off = pe[ i ] + 1;
+			}
+
+			field_idx += n;
+			fields_read += n;
+			cur_field_offset = off;
+		}
+
+		if ( scan_truncated && cur_field_offset <= cur_line_length )
+			skip_to_row_end();
+
+		if ( row_end )
+			*row_end = ( skipped_end ? skipped_end : cur_line_length );
+
+		return n;
+	}
+
+	// scalar parser, the line may move to line_copy while reading a multi-line field
+	offsets->clear();
+	lengths->clear();
+
+	unsigned f_off = 0, f_len = 0;
+	while ( read_csv_field( line_start, &f_off, &f_len ) )
+	{
+		offsets->push_back( f_off );
+		lengths->push_back( f_len );
+	}
+	*line_start = cur_line;
+	if ( row_end )
+		*row_end = ( skipped_end ? skipped_end : f_off + f_len );
+
+	return offsets->size();
+}
+
+csv_batch::csv_batch ( const unsigned columns, const unsigned max_rows ) :
+	field_off( columns * max_rows ),
+	columns(columns),
+	max_rows(max_rows),
+	rows(0),
+	field_start( columns * max_rows ),
+	field_length( columns * max_rows ),
+	field_count( max_rows ),
+	row_start( max_rows ),
+	row_length( max_rows ),
+	quote_free(false)
+{
+	rows_copy_off.resize( max_rows );
+}
+
+// read the current row and the following ones into batch, up to batch->max_rows rows
+// returns false if no row could be read (end of input)
+bool csv_reader::read_batch ( csv_batch *batch )
+{
+	const bool mapped = input_lines->is_mapped();
+	const unsigned columns = batch->columns;
+	const unsigned stride = batch->max_rows;
+
+	batch->rows = 0;
+	batch->rows_copy.clear();
+	batch->quote_free = true;
+
+	if ( failed )
+		return false;
+
+	do
+	{
+		const unsigned r = batch->rows++;
+		char *line = NULL;
+		unsigned row_end = 0;
+		const unsigned n = read_row( &line, &batch->cur_off, &batch->cur_len, &row_end );
+		const unsigned nc = ( n < columns ? n : columns );
+
+		batch->field_count[ r ] = n + skipped_fields;
+		batch->quote_free &= row_quote_free;
+		batch->row_length[ r ] = row_end;
+
+		if ( mapped )
+			batch->row_start[ r ] = line;
+		else
+		{
+			// the line buffer is reused by the next fetch_line()
+			batch->rows_copy_off[ r ] = batch->rows_copy.size();
+			batch->rows_copy.insert( batch->rows_copy.end(), line, line + row_end );
+		}
+
+		for ( unsigned c = 0 ; c < nc ; ++c )
+		{
+			batch->field_off[ c * stride + r ] = batch->cur_off[ c ];
+			batch->field_length[ c * stride + r ] = batch->cur_len[ c ];
+		}
+		for ( unsigned c = nc ; c < columns ; ++c )
+		{
+			batch->field_off[ c * stride + r ] = 0;
+			batch->field_length[ c * stride + r ] = 0;
+		}
+
+	} while ( fetch_line() && batch->rows < stride );
+
+	const unsigned rows = batch->rows;
+
+	if ( ! mapped )
+		for ( unsigned r = 0 ; r < rows ; ++r )
+			batch->row_start[ r ] = ( batch->rows_copy.empty() ? NULL : &batch->rows_copy[ 0 ] ) + batch->rows_copy_off[ r ];
+
+	for ( unsigned c = 0 ; c < columns ; ++c )
+	{
+		char **fs = &batch->field_start[ c * stride ];
+		const unsigned *fo = &batch->field_off[ c * stride ];
+		for ( unsigned r = 0 ; r < rows ; ++r )
+			fs[ r ] = batch->row_start[ r ] + fo[ r ];
+	}
+
+	return true;
+}
+
 // same as read_csv_field ( line_start, field_offset, field_length ) with simpler args
 // returned values are only valid until the next call to this function (with the 3-args version, it is valid until fetch_line())
 bool csv_reader::read_csv_field ( char* *field_start, unsigned *field_length )
@@ -616,10 +1654,11 @@ bool csv_reader::read_csv_field ( char* *field_start, unsigned *field_length )
 // return an unescaped csv field
 // if unescaped is not NULL, fill it with unescaped data (data appended, string should be empty on call)
 // if unescaped is NULL, and field has no escaped quote, only update field_start and field_length to reflect unescaped data (zero copy)
-// if unescaped is NULL, and field has escaped quotes, allocate a new string and fill it with unescaped data. Caller should free it.
+// if unescaped is NULL, and field has escaped quotes, the unescaped data is copied in a scratch area owned by the reader, and
+//  field_start and field_length are updated to point to it. It is valid until the next fetch_line() (or read_batch()).
 // returns a pointer to unescaped
 // on return, if unescaped is not NULL, field_start and field_length are undefined.
-std::string* csv_reader::unescape_csv_field ( char* *field_start, unsigned *field_length, std::string* unescaped ) const
+std::string* csv_reader::unescape_csv_field ( char* *field_start, unsigned *field_length, std::string* unescaped )
 {
 	if ( *field_length <= 0 )
 		return unescaped;
@@ -636,6 +1675,45 @@ std::string* csv_reader::unescape_csv_field ( char* *field_start, unsigned *fiel
 	--*field_length;
 	--*field_length;
 
+	if ( ! unescaped )
+	{
+		char *pquot = NULL;
+		if ( *field_length > 0 )
+			pquot = (char*)memchr( (void*)*field_start, quot, *field_length );
+
+		if ( ! pquot )
+			return NULL;
+
+		// escaped quotes: compact into scratch memory (the unescaped field is shorter than the raw one)
+		char *src = *field_start;
+		char *end = src + *field_length;
+		char *out = scratch_alloc( *field_length );
+		char *dst = out;
+
+		while ( pquot )
+		{
+			// copy up to and including the first quote of the pair
+			memcpy( dst, src, pquot - src + 1 );
+			dst += pquot - src + 1;
+			src = pquot + 2;
+
+			pquot = NULL;
+			if ( src < end )
+				pquot = (char*)memchr( (void*)src, quot, end - src );
+		}
+
+		if ( src < end )
+		{
+			memcpy( dst, src, end - src );
+			dst += end - src;
+		}
+
+		*field_start = out;
+		*field_length = dst - out;
+
+		return NULL;
+	}
+
 	while (1)
 	{
 		char *pquot = NULL;
@@ -646,9 +1724,6 @@ std::string* csv_reader::unescape_csv_field ( char* *field_start, unsigned *fiel
 		if ( pquot )
 		{
 			// found quote: must be an escape
-			if ( ! unescaped )
-				unescaped = new std::string;
-
 			// append string start, including 1 quot
 			unescaped->append( *field_start, pquot - *field_start + 1 );
 			*field_length -= pquot - *field_start + 2;
@@ -664,38 +1739,6 @@ std::string* csv_reader::unescape_csv_field ( char* *field_start, unsigned *fiel
 	}
 }
 
-// return the escaped version of an unescaped string
-std::string csv_reader::escape_csv_string ( const std::string &str, const char quot )
-{
-	std::string ret;
-
-	if ( str.size() == 0 )
-		return ret;
-
-	ret.push_back( quot );
-
-	size_t last = 0, next = str.find( quot );
-	while ( next != std::string::npos )
-	{
-		ret.append( str.substr( last, next-last ) );
-		ret.push_back( quot );
-		ret.push_back( quot );
-
-		last = next + 1;
-		next = str.find( quot, last );
-	}
-
-	ret.append( str.substr( last ) );
-	ret.push_back( quot );
-
-	return ret;
-}
-
-std::string csv_reader::escape_csv_field ( const std::string &str ) const
-{
-	return csv_reader::escape_csv_string( str, quot );
-}
-
 // parse the current csv line (after a call to fetch_line())
 // return a pointer to a vector of unescaped strings, should be delete by caller
 std::vector<std::string>* csv_reader::parse_line ( )
@@ -706,9 +1749,8 @@ std::vector<std::string>* csv_reader::parse_line ( )
 
 	while ( read_csv_field( &field_start, &field_length ) )
 	{
-		std::string unescaped;
-		unescape_csv_field( &field_start, &field_length, &unescaped );
-		vec->push_back( unescaped );
+		vec->push_back( std::string() );
+		unescape_csv_field( &field_start, &field_length, &vec->back() );
 	}
 
 	return vec;
@@ -1,10 +1,78 @@
 #ifndef CSVREADER_H
 #define CSVREADER_H
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 class line_reader;
+struct row_checkpoint;
+
+/*
+ * A block of consecutive csv rows, stored column by column (see csv_reader::read_batch)
+ *
+ * Only the first 'columns' fields of each row are stored, as (pointer, length) arrays indexed by column then row, so that
+ * callers can run one tight loop per column. Missing fields (short rows) are empty, field_count tells the actual field count.
+ * Fields are raw csv data, as returned by read_csv_field (use unescape_csv_field as needed).
+ * For mapped inputs the pointers point into the file mapping, other inputs are copied into the batch buffer.
+ * Everything stays valid until the next read_batch() with this batch.
+ */
+class csv_batch
+{
+	friend class csv_reader;
+
+private:
+	// copy of the rows of unmapped inputs, and offset of each row in it
+	std::vector<char> rows_copy;
+	std::vector<size_t> rows_copy_off;
+
+	// field offsets relative to their row start, converted to pointers once the batch is complete
+	std::vector<unsigned> field_off;
+
+	// read_row() output for the current row
+	std::vector<unsigned> cur_off;
+	std::vector<unsigned> cur_len;
+
+public:
+	const unsigned columns;
+	const unsigned max_rows;
+
+	// number of rows in the batch
+	unsigned rows;
+
+	// field c of row r is field_start[ c * max_rows + r ], field_length[ c * max_rows + r ]
+	std::vector<char *> field_start;
+	std::vector<unsigned> field_length;
+
+	// number of csv fields of each row (may be more or less than columns), including the fields skipped (see set_max_fields)
+	std::vector<unsigned> field_count;
+
+	// raw row data, up to the last byte parsed (includes all fields, not only the stored columns)
+	std::vector<char *> row_start;
+	std::vector<unsigned> row_length;
+
+	// no row of the batch contains a quote character, the fields need no unescaping
+	bool quote_free;
+
+	explicit csv_batch ( const unsigned columns, const unsigned max_rows = 4096 );
+
+	char *field ( const unsigned c, const unsigned r ) const { return field_start[ c * max_rows + r ]; }
+	unsigned length ( const unsigned c, const unsigned r ) const { return field_length[ c * max_rows + r ]; }
+
+private:
+	csv_batch ( const csv_batch& );
+	csv_batch& operator=( const csv_batch& );
+};
 
 class csv_reader
 {
+public:
+	// template argument of scan_fields() for a separator or quote only known at runtime
+	enum { DELIM_ANY = -1 };
+
+	// vectorized kernel of scan_fields(): separator and quote bitmaps of nblocks blocks of 64 bytes (see cpu_features.h)
+	typedef void ( *scan_blocks_fn )( const char *p, const unsigned nblocks, const char sep, const char quot, uint64_t *masks );
+
 private:
 	line_reader *input_lines;
 	unsigned line_max;
@@ -19,9 +87,67 @@ private:
 	unsigned cur_line_length_nl;
 	unsigned cur_field_offset;
 
+	// input offset of the current row, and offset where fetch_line() stops returning rows
+	uint64_t cur_row_offset;
+	uint64_t row_limit;
+
+	// field boundaries of the current line, as found by scan_fields()
+	// field_ends[ i ] is the offset of the separator ending the field i (or cur_line_length for the last field)
+	std::vector<unsigned> field_ends;
+	unsigned field_idx;
+	enum { SCAN_PENDING, SCAN_DONE, SCAN_SCALAR } scan_state;
+	// scan_fields() stopped after max_fields fields, the rest of the line has no quote
+	bool scan_truncated;
+	// the current row has no quote character (see line_reader::quote_free): it is a single line, its fields need no unescaping
+	bool row_quote_free;
+
+	// fields after the max_fields first ones are not returned (see set_max_fields), 0 for no limit
+	unsigned max_fields;
+	// number of fields returned for the current line
+	unsigned fields_read;
+	// end of the current row if its last fields were skipped, else 0, and number of fields skipped
+	unsigned skipped_end;
+	unsigned skipped_fields;
+
+	// scratch memory for unescaped fields, reused after each fetch_line() (chunks are never moved or freed before the destructor)
+	struct scratch_chunk {
+		char *ptr;
+		size_t size;
+	};
+	std::vector<scratch_chunk> scratch;
+	unsigned scratch_cur;
+	size_t scratch_used;
+
+	// return len bytes of scratch memory
+	char *scratch_alloc ( size_t len );
+
 	// set cur_line_length from cur_line_length_nl, trim \r\n
 	void trim_newlines ( );
 
+	// forget the current row after a seek
+	void reset_row ( );
+
+	// split the current line in fields using separator/quote bitmaps, fill field_ends
+	// return false if the line must go through the scalar parser (multi-line field, quote in an unquoted field, syntax error)
+	template< int SEP, int QUOT >
+	bool scan_fields ( );
+
+	// instance of scan_fields() for sep and quot, chosen in the constructor
+	bool ( csv_reader::*scan_fields_fn )( );
+	void select_scan_fields ( );
+
+	// number of 64 bytes blocks passed to scan_blocks at once
+	static const unsigned scan_batch = 8;
+	scan_blocks_fn scan_blocks;
+	void load_masks ( const unsigned off, uint64_t *masks ) const;
+
+	// read_csv_field without the max_fields check
+	bool parse_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length );
+
+	// skip the rest of the current row once max_fields fields are read, return false if it cannot be skipped
+	bool skip_fields ( );
+	void skip_to_row_end ( );
+
 public:
 	bool failed_to_open ( ) const;
 
@@ -31,8 +157,47 @@ public:
 	// reset cur_field_offset to 0, so that subsequent read_csv_field() re-output the current row fields
 	void reset_cur_field_offset ( );
 
+	// return true if the input is a regular file mapped in memory (see line_reader)
+	bool is_mapped ( ) const;
+
+	// for a mapped input, get the file descriptor (owned by the reader), the mapping and the file size
+	// the data at an offset of the mapping is the data at the same offset of the file, unless rows were modified in place
+	// return false for other inputs
+	bool mapped_input ( int *fd, const char* *data, uint64_t *size ) const;
+
+	// return the input offset of the current row (valid after fetch_line())
+	uint64_t row_offset ( ) const;
+
+	// return the input offset of the next row to be returned by fetch_line()
+	// only meaningful once all fields of the current row have been read (a quoted field may span multiple lines)
+	uint64_t next_row_offset ( ) const;
+
+	// move to an arbitrary offset of a mapped input, which should be a row start
+	// the next fetch_line() returns the row at this offset
+	bool seek ( uint64_t off );
+
+	// move to the row of a checkpoint of the input row_index (mapped or gzip input), the next fetch_line() returns this row
+	// return false if the input cannot seek (eg stdin), the reader is unusable if the seek fails after restarting the inflate
+	bool seek ( const row_checkpoint &cp );
+
+	// fetch_line() will return false instead of returning a row starting at or after this offset
+	// 0 means no limit
+	void set_row_limit ( uint64_t off );
+
+	// only the first n fields of each row will be used (0 = all fields), should be set before reading the rows
+	// once n fields of a row are read, if the rest of the line has no quote (so no field can span lines), the reader jumps to the
+	// end of the row and read_csv_field() returns false ; read_row() still reports the full extent of the row in row_end
+	// otherwise the remaining fields are returned as usual
+	void set_max_fields ( unsigned n );
+
+	// number of fields at the end of the current row that were skipped because of set_max_fields, the row ends at row_end (see read_row)
+	unsigned skipped_field_count ( ) const;
+
 	// line_max is passed to the line_reader, it is also the limit for a full csv row (that may span many lines)
-	explicit csv_reader ( const char *filename, const char sep = ',', const char quot = '"', const unsigned line_max = 64*1024 );
+	// rows spanning many lines are limited in all inputs, single lines only for inputs that are not mmapped (regular
+	//  uncompressed files are mmapped as a whole, their lines are only limited to UINT_MAX bytes)
+	// readahead reads uncompressed inputs (including regular files, which are not mmapped then) from a background thread
+	explicit csv_reader ( const char *filename, const char sep = ',', const char quot = '"', const unsigned line_max = 64*1024, const bool readahead = false );
 	~csv_reader ( );
 
 	// read one line from input_lines
@@ -46,6 +211,18 @@ public:
 	// the 'field_offset' returned by previous calls for the same line is still valid relative to the new 'line_start' (which may change if one field crosses a line boundary, in that case the lines are copied into an internal buffer)
 	bool read_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length );
 
+	// read all the remaining fields of the current line, same as calling read_csv_field() until it returns false
+	// offsets and lengths are resized to the number of fields, offsets are relative to line_start, valid until fetch_line()
+	// the vectors are owned by the caller, and should be reused from one row to the next to avoid allocations
+	// if row_end is not NULL, it is set to the offset after the last byte parsed (end of the last field, or syntax error position)
+	// returns the number of fields read
+	unsigned read_row ( char* *line_start, std::vector<unsigned> *offsets, std::vector<unsigned> *lengths, unsigned *row_end = NULL );
+
+	// read the current row and the following ones into batch, up to batch->max_rows rows
+	// the current row must have been fetched (as with read_csv_field) ; on return the current row is the first row of the next batch
+	// returns false if no row could be read (end of input)
+	bool read_batch ( csv_batch *batch );
+
 	// same as read_csv_field ( line_start, field_offset, field_length ) with simpler args
 	// returned values are only valid until the next call to this function (with the 3-args version, it is valid until fetch_line())
 	bool read_csv_field ( char* *field_start, unsigned *field_length );
@@ -53,15 +230,11 @@ public:
 	// return an unescaped csv field
 	// if unescaped is not NULL, fill it with unescaped data (data appended, string should be empty on call)
 	// if unescaped is NULL, and field has no escaped quote, only update field_start and field_length to reflect unescaped data (zero copy)
-	// if unescaped is NULL, and field has escaped quotes, allocate a new string and fill it with unescaped data. Caller should free it.
+	// if unescaped is NULL, and field has escaped quotes, the unescaped data is copied in a scratch area owned by the reader, and
+	//  field_start and field_length are updated to point to it. It is valid until the next fetch_line() (or read_batch()).
 	// returns a pointer to unescaped
 	// on return, if unescaped is not NULL, field_start and field_length are undefined.
-	std::string* unescape_csv_field ( char* *field_start, unsigned *field_length, std::string* unescaped = NULL ) const;
-
-	static std::string escape_csv_string ( const std::string &str, const char quot = '"' );
-
-	// return the escaped version of an unescaped string
-	std::string escape_csv_field ( const std::string &str ) const;
+	std::string* unescape_csv_field ( char* *field_start, unsigned *field_length, std::string* unescaped = NULL );
 
 	// parse the current csv line (after a call to fetch_line())
 	// return a pointer to a vector of unescaped strings, should be delete by caller
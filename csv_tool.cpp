@@ -5,11 +5,16 @@
 #include <fstream>
 #include <errno.h>
 #include <vector>
+#include <algorithm>
 #include <regex.h>
 #include <tr1/unordered_set>
 
 #include "output_buffer.h"
 #include "csv_reader.h"
+#include "parallel_reader.h"
+#include "row_index.h"
+#include "num_conv.h"
+#include "multi_regex.h"
 
 
 #define CSV_TOOL_VERSION "20140829"
@@ -20,8 +25,18 @@ enum {
 	RE_INVERT,
 	UNIQ_COLS,
 	EXTRACT_ZERO,
+	READAHEAD,
 };
 
+// rows copied unchanged from the input file (see rows) are checked by chunks of this size
+static const size_t passthrough_chunk = 64*1024*1024;
+// shorter stretches of unchanged rows are parsed, to avoid a flush and a syscall for a few rows
+static const size_t passthrough_min = 256*1024;
+
+// grepcol looks for the literals required by the regexes of a column before matching them, if there are at most this many
+// (with more literals, the automaton is faster than a memmem for each one)
+static const unsigned prefilter_max_literals = 4;
+
 class csv_tool
 {
 private:
@@ -29,6 +44,7 @@ private:
 	char sep_out;
 	char quot;
 	unsigned line_max;
+	unsigned nthreads;
 public:
 	unsigned csv_flags;
 private:
@@ -73,56 +89,50 @@ private:
 		}
 
 		// count columns on the current row
-		char *ptr = NULL;
-		unsigned len = 0;
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
 
-		max_index = 0;
-		while ( reader->read_csv_field( &ptr, &len ) )
-			++max_index;
+		max_index = reader->read_row( &line, &f_off, &f_len );
 
 		// reset internal ptr for subsequent read_csv_fields
 		reader->reset_cur_field_offset();
 	}
 
+	// number of leading input columns used by the colspec (see csv_reader::set_max_fields), 0 if none
+	unsigned needed_fields ( ) const
+	{
+		unsigned n = inv_indexes.size();
+		while ( n > 0 && inv_indexes[ n - 1 ].empty() )
+			--n;
+
+		return n;
+	}
+
 	// parse an unsigned long long
 	// return 0 on invalid character
 	// handle 0x prefix
-	int str_ull( const std::string &str, unsigned long long *ret ) const
+	int str_ull( const char *str, const size_t len, unsigned long long *ret ) const
 	{
 		*ret = 0;
 
-		if ( str.size() > 2 && str[0] == '0' && str[1] == 'x' )
-		{
-			for ( unsigned i = 2 ; i < str.size() ; ++i )
-			{
-				if ( (*ret >> 60) > 0 )
-					return 0;
-				else if ( str[i] >= '0' && str[i] <= '9' )
-					*ret = *ret * 16 + (str[i] - '0');
-				else if ( str[i] >= 'A' && str[i] <= 'F' )
-					*ret = *ret * 16 + (str[i] - 'A' + 10);
-				else if ( str[i] >= 'a' && str[i] <= 'f' )
-					*ret = *ret * 16 + (str[i] - 'a' + 10);
-				else
-					return 0;
-			}
-		}
-		else
-		{
-			for ( unsigned i = 0 ; i < str.size() ; ++i )
-			{
-				if ( (*ret >> 60) > 0 )
-					return 0;
-				else if ( str[i] >= '0' && str[i] <= '9' )
-					*ret = *ret * 10 + (str[i] - '0');
-				else
-					return 0;
-			}
-		}
+		if ( len > 2 && str[0] == '0' && str[1] == 'x' )
+			return parse_hex( str + 2, len - 2, ret );
+
+		// up to 10*2^60
+		unsigned long long v;
+		if ( ! parse_ull( str, len, &v ) || ( (v / 10) >> 60 ) > 0 )
+			return 0;
+
+		*ret = v;
 
 		return 1;
 	}
 
+	int str_ull( const std::string &str, unsigned long long *ret ) const
+	{
+		return str_ull( str.data(), str.size(), ret );
+	}
+
 	int str_ul( const std::string &str, unsigned long *ret ) const
 	{
 		unsigned long long ull;
@@ -291,7 +301,7 @@ private:
 	{
 		cleanup();
 
-		reader = new csv_reader( filename, sep, quot, line_max );
+		reader = new csv_reader( filename, sep, quot, line_max, HAS_FLAG( READAHEAD ) );
 
 		if ( reader->failed_to_open() )
 		{
@@ -357,15 +367,86 @@ private:
 		}
 	}
 
-	std::string ull_str ( const unsigned long long nr, const char *fmt = "%llu" )
+	std::string ull_str ( const unsigned long long nr )
 	{
-		char buf[16];
-		unsigned buf_sz = snprintf( buf, sizeof(buf), fmt, nr );
-		if ( buf_sz > sizeof(buf) )
-			buf_sz = sizeof(buf);
+		return ull_string( nr );
+	}
 
-		std::string ret( buf, buf_sz );
-		return ret;
+	// regexec on a field that is not nul-terminated (the match stops at a nul byte, as with a c string)
+	static bool regexec_field ( const regex_t *re, const char *ptr, unsigned len )
+	{
+		const char *nul = (const char *)memchr( ptr, 0, len );
+		if ( nul )
+			len = nul - ptr;
+
+#ifdef REG_STARTEND
+		regmatch_t m;
+		m.rm_so = 0;
+		m.rm_eo = len;
+
+		return regexec( re, ptr, 1, &m, REG_STARTEND ) != REG_NOMATCH;
+#else
+		return regexec( re, std::string( ptr, len ).c_str(), 0, NULL, 0 ) != REG_NOMATCH;
+#endif
+	}
+
+	// return true if the field holds one of the strings
+	static bool has_literal ( const char *ptr, const unsigned len, const std::vector< std::string > &lits )
+	{
+		for ( unsigned i = 0 ; i < lits.size() ; ++i )
+			if ( memmem( ptr, len, lits[ i ].data(), lits[ i ].size() ) )
+				return true;
+
+		return false;
+	}
+
+	// add a slice to an output_buffer gather list
+	static void push_iov ( std::vector<struct iovec> *iov, const char *ptr, const unsigned len )
+	{
+		struct iovec v;
+		v.iov_base = (void *)ptr;
+		v.iov_len = len;
+		iov->push_back( v );
+	}
+
+	// return the length of the leading rows of p that rows() outputs unchanged with sep_out == sep: no quote, ended by \r\n
+	// stop is set to the offset of the first byte that needs parsing (quote or bare \n), len if none
+	// the quotes are searched by blocks, so that the scan stops soon after the first one
+	static size_t plain_crlf_rows ( const char *p, const size_t len, const char quot, size_t *stop )
+	{
+		size_t end = 0;
+		size_t pos = 0;
+
+		*stop = len;
+
+		while ( pos < len )
+		{
+			const size_t block_end = ( len - pos > 4096 ? pos + 4096 : len );
+			const char *q = (const char *)memchr( p + pos, quot, block_end - pos );
+			const size_t lim = ( q ? q - p : block_end );
+			const char *nl;
+
+			while ( ( nl = (const char *)memchr( p + pos, '\n', lim - pos ) ) )
+			{
+				if ( nl == p + end || nl[ -1 ] != '\r' )
+				{
+					*stop = nl - p;
+					return end;
+				}
+
+				end = pos = nl + 1 - p;
+			}
+
+			if ( q )
+			{
+				*stop = lim;
+				return end;
+			}
+
+			pos = block_end;
+		}
+
+		return end;
 	}
 
 	std::string str_downcase( const std::string &str )
@@ -378,12 +459,36 @@ private:
 		return ret;
 	}
 
+	// run a row loop on the current reader row and all subsequent rows
+	// with -j, and if the input is a regular file, split the rows in chunks handled by many threads
+	void run_rows ( parallel_reader::chunk_handler handler, const char *filename )
+	{
+		if ( nthreads > 1 )
+		{
+			if ( reader->is_mapped() )
+			{
+				parallel_reader par( filename, sep, quot, line_max, nthreads );
+				if ( ! par.failed_to_open() )
+				{
+					par.run( reader->row_offset(), handler, this, outbuf );
+					return;
+				}
+			}
+
+			// stdin, compressed input, -R, or the file could not be mapped
+			std::cerr << "Cannot split " << ( filename ? filename : "stdin" ) << " in chunks, ignoring -j" << std::endl;
+		}
+
+		handler( this, reader, outbuf );
+	}
+
 public:
-	explicit csv_tool ( output_buffer *outbuf, char sep = ',', char sep_out = ',', char quot = '"', unsigned line_max = 64*1024, unsigned csv_flags = 0 ) :
+	explicit csv_tool ( output_buffer *outbuf, char sep = ',', char sep_out = ',', char quot = '"', unsigned line_max = 64*1024, unsigned csv_flags = 0, unsigned nthreads = 1 ) :
 		sep(sep),
 		sep_out(sep_out),
 		quot(quot),
 		line_max(line_max),
+		nthreads(nthreads),
 		csv_flags(csv_flags),
 		outbuf(outbuf),
 		reader(NULL),
@@ -416,39 +521,45 @@ public:
 		if ( reader->eos() )
 			return;
 
+		run_rows( extract_rows, filename );
+	}
+
+	// extract() row loop
+	static void extract_rows ( void *ctx, csv_reader *rd, output_buffer *out )
+	{
+		csv_tool *self = (csv_tool *)ctx;
+
 		int zero = 0;
-		if ( HAS_FLAG( EXTRACT_ZERO ) )
+		if ( self->csv_flags & ( 1 << EXTRACT_ZERO ) )
 			zero = 1;	// lol!
 
+		rd->set_max_fields( self->needed_fields() );
+
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
+
 		do
 		{
-			char *ptr = NULL;
-			unsigned len = 0;
-			unsigned idx_in = 0;
+			// the reader skips the fields after the extracted one, unless one of them may include a newline
+			const unsigned n_fields = rd->read_row( &line, &f_off, &f_len );
+			const unsigned n_idx = ( n_fields < self->inv_indexes.size() ? n_fields : self->inv_indexes.size() );
 
-			while ( reader->read_csv_field( &ptr, &len ) )
+			for ( unsigned idx_in = 0 ; idx_in < n_idx ; ++idx_in )
 			{
-				if ( ( idx_in < inv_indexes.size() ) && ( inv_indexes[ idx_in ].size() > 0 ) )
+				if ( self->inv_indexes[ idx_in ].size() > 0 )
 				{
-					std::string *str = reader->unescape_csv_field( &ptr, &len );
-					if ( str )
-					{
-						outbuf->append( str );
-						delete str;
-					}
-					else
-						outbuf->append( ptr, len );
+					char *ptr = line + f_off[ idx_in ];
+					unsigned len = f_len[ idx_in ];
+					rd->unescape_csv_field( &ptr, &len );
+					out->append( ptr, len );
 				}
-
-				// cannot break: a later field may include a newline
-				++idx_in;
 			}
 			if ( zero )
-				outbuf->append( '\0' );
+				out->append( '\0' );
 			else
-				outbuf->append_nl();
+				out->append_nl();
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 	}
 
 
@@ -469,7 +580,7 @@ public:
 				int idx_in = indexes[ i ];
 
 				if ( idx_in != -1 )
-					outbuf->append( reader->escape_csv_field( (*headers)[ idx_in ] ) );
+					outbuf->append_csv_field( (*headers)[ idx_in ], sep_out, quot );
 			}
 			outbuf->append_nl();
 		}
@@ -477,10 +588,26 @@ public:
 		if ( reader->eos() )
 			return out_colspec;
 
-		unsigned idx_len = indexes.size();
+		run_rows( select_rows, filename );
+
+		return out_colspec;
+	}
+
+	// select() row loop
+	static void select_rows ( void *ctx, csv_reader *rd, output_buffer *out )
+	{
+		csv_tool *self = (csv_tool *)ctx;
+		const std::vector< std::vector<unsigned> > &inv_indexes = self->inv_indexes;
+
+		rd->set_max_fields( self->needed_fields() );
+
+		unsigned idx_len = self->indexes.size();
 		unsigned *fld_off = new unsigned[ idx_len ];
 		unsigned *fld_len = new unsigned[ idx_len ];
-		const bool may_need_escape = ( sep_out != sep );
+		const bool may_need_escape = ( self->sep_out != self->sep );
+		char *line = NULL;
+		std::vector<unsigned> row_off, row_len;
+		std::vector<struct iovec> iov;
 
 		do
 		{
@@ -488,49 +615,47 @@ public:
 				fld_off[ idx_out ] = (unsigned)-1;
 
 			// parse input row
-			char *line = NULL;
-			unsigned f_off = 0, f_len = 0;
-			unsigned idx_in = 0;
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			const unsigned n_fields = rd->read_row( &line, &row_off, &row_len );
+			const unsigned n_idx = ( n_fields < inv_indexes.size() ? n_fields : inv_indexes.size() );
+			for ( unsigned idx_in = 0 ; idx_in < n_idx ; ++idx_in )
 			{
-				if ( idx_in < inv_indexes.size() && inv_indexes[ idx_in ].size() )
+				// current input field appears in output, save its off+len
+				for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
 				{
-					// current input field appears in output, save its off+len
-					for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
-					{
-						unsigned idx_out = inv_indexes[ idx_in ][ i ];
-						fld_off[ idx_out ] = f_off;
-						fld_len[ idx_out ] = f_len;
-					}
+					unsigned idx_out = inv_indexes[ idx_in ][ i ];
+					fld_off[ idx_out ] = row_off[ idx_in ];
+					fld_len[ idx_out ] = row_len[ idx_in ];
 				}
-				++idx_in;
 			}
 
-			// generate output row
+			// generate output row, gather the slices of the input line
+			iov.clear();
 			for ( unsigned idx_out = 0 ; idx_out < idx_len ; ++idx_out )
 			{
 				if ( idx_out > 0 )
-					outbuf->append( sep_out );
+					push_iov( &iov, &self->sep_out, 1 );
 
 				if ( fld_off[ idx_out ] != (unsigned)-1 )
 				{
-					if ( may_need_escape && fld_len[ idx_out ] && ( line[ fld_off[ idx_out ] ] != quot ) )
+					if ( may_need_escape && fld_len[ idx_out ] && ( line[ fld_off[ idx_out ] ] != self->quot ) &&
+							output_buffer::csv_needs_quotes( line + fld_off[ idx_out ], fld_len[ idx_out ], self->sep_out, self->quot ) )
 					{
-						std::string raw_f( line + fld_off[ idx_out ], fld_len[ idx_out ] );
-						outbuf->append( reader->escape_csv_field( raw_f ) );
+						out->append( &iov[ 0 ], iov.size() );
+						iov.clear();
+
+						out->append_csv_field( line + fld_off[ idx_out ], fld_len[ idx_out ], self->sep_out, self->quot );
 					} else
-						outbuf->append( line + fld_off[ idx_out ], fld_len[ idx_out ] );
+						push_iov( &iov, line + fld_off[ idx_out ], fld_len[ idx_out ] );
 				}
 			}
-			outbuf->append_nl();
+			push_iov( &iov, "\r\n", 2 );
+			out->append( &iov[ 0 ], iov.size() );
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 
 
 		delete[] fld_off;
 		delete[] fld_len;
-
-		return out_colspec;
 	}
 
 
@@ -552,7 +677,7 @@ public:
 				if ( colnum_out++ > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[ i ] ) );
+				outbuf->append_csv_field( (*headers)[ i ], sep_out, quot );
 
 				++colnum_out;
 			}
@@ -562,27 +687,39 @@ public:
 		if ( reader->eos() )
 			return;
 
+		run_rows( deselect_rows, filename );
+	}
+
+	// deselect() row loop
+	static void deselect_rows ( void *ctx, csv_reader *rd, output_buffer *out )
+	{
+		csv_tool *self = (csv_tool *)ctx;
+
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
+		std::vector<struct iovec> iov;
+
 		do
 		{
-			char *fld = NULL;
-			unsigned fld_len = 0;
-			unsigned colnum = 0;
+			const unsigned n_fields = rd->read_row( &line, &f_off, &f_len );
 			unsigned colnum_out = 0;
 
-			while ( reader->read_csv_field( &fld, &fld_len ) )
+			iov.clear();
+			for ( unsigned colnum = 0 ; colnum < n_fields ; ++colnum )
 			{
-				if ( inv_indexes[ colnum++ ].size() )
+				if ( colnum < self->inv_indexes.size() && self->inv_indexes[ colnum ].size() )
 					continue;
 
 				if ( colnum_out++ > 0 )
-					outbuf->append( sep_out );
+					push_iov( &iov, &self->sep_out, 1 );
 
-				outbuf->append( fld, fld_len );
+				push_iov( &iov, line + f_off[ colnum ], f_len[ colnum ] );
 			}
 
-			outbuf->append_nl();
+			push_iov( &iov, "\r\n", 2 );
+			out->append( &iov[ 0 ], iov.size() );
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 	}
 
 
@@ -626,13 +763,13 @@ public:
 		{
 			for ( unsigned i = 0 ; i < cols.size() ; ++i )
 			{
-				outbuf->append( reader->escape_csv_field( cols[i] ) );
+				outbuf->append_csv_field( cols[i], sep_out, quot );
 				outbuf->append( sep_out );
 			}
 
 			for ( unsigned i = 0 ; i < headers->size() ; ++i )
 			{
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_csv_field( (*headers)[i], sep_out, quot );
 
 				if ( i + 1 < headers->size() )
 					outbuf->append( sep_out );
@@ -644,6 +781,9 @@ public:
 		if ( reader->eos() )
 			return;
 
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
+
 		do
 		{
 			for ( unsigned i = 0 ; i < vals.size() ; ++i )
@@ -653,13 +793,11 @@ public:
 				outbuf->append( vals[ i ] );
 			}
 
-			char *fld = NULL;
-			unsigned fld_len = 0;
-
-			while ( reader->read_csv_field( &fld, &fld_len ) )
+			const unsigned n_fields = reader->read_row( &line, &f_off, &f_len );
+			for ( unsigned i = 0 ; i < n_fields ; ++i )
 			{
 				outbuf->append( sep_out );
-				outbuf->append( fld, fld_len );
+				outbuf->append( line + f_off[ i ], f_len[ i ] );
 			}
 
 			outbuf->append_nl();
@@ -726,7 +864,7 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_csv_field( (*headers)[i], sep_out, quot );
 			}
 
 			outbuf->append_nl();
@@ -741,55 +879,131 @@ public:
 			return;
 		}
 
+		// the patterns of each column are matched together by a single automaton, regexec is only used for the
+		// patterns it does not support
+		// fields holding none of the literals required by the patterns of their column are rejected without matching
+		std::vector< multi_regex * > col_dfa( inv_indexes.size(), (multi_regex *)NULL );
+		std::vector< std::vector< unsigned > > col_re( inv_indexes.size() );
+		std::vector< std::vector< std::string > > col_lits( inv_indexes.size() );
+		for ( unsigned idx_in = 0 ; idx_in < inv_indexes.size() ; ++idx_in )
+		{
+			bool prefilter = ! HAS_FLAG( RE_NOCASE );
+			std::vector< std::string > lits;
+
+			for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
+			{
+				unsigned idx_g = inv_indexes[ idx_in ][ i ];
+				if ( idx_g >= vals.size() )
+					continue;
+
+				if ( ! col_dfa[ idx_in ] )
+					col_dfa[ idx_in ] = new multi_regex( HAS_FLAG( RE_NOCASE ) );
+
+				if ( ! col_dfa[ idx_in ]->add( vals[ idx_g ] ) )
+					col_re[ idx_in ].push_back( idx_g );
+
+				if ( prefilter && ! multi_regex::required_literals( vals[ idx_g ], &lits ) )
+					prefilter = false;
+			}
+
+			if ( col_dfa[ idx_in ] && ! col_dfa[ idx_in ]->size() )
+			{
+				delete col_dfa[ idx_in ];
+				col_dfa[ idx_in ] = NULL;
+			}
+
+			if ( ! prefilter )
+				continue;
+
+			// a field holding a literal also holds the literals it contains: only keep those
+			for ( unsigned i = 0 ; i < lits.size() ; ++i )
+			{
+				bool useless = false;
+				for ( unsigned j = 0 ; j < lits.size() && ! useless ; ++j )
+					if ( j != i && lits[ i ].find( lits[ j ] ) != std::string::npos )
+						useless = ( lits[ i ] != lits[ j ] || j < i );
+
+				if ( ! useless )
+					col_lits[ idx_in ].push_back( lits[ i ] );
+			}
+
+			if ( col_lits[ idx_in ].size() > prefilter_max_literals )
+				col_lits[ idx_in ].clear();
+		}
+
 		const unsigned stats_batch_size = 16*1024;
 		unsigned stats_seen = 0;
 		unsigned stats_match = (headers ? 1 : 0);
 		bool invert = HAS_FLAG( RE_INVERT );
-		do
+
+		// match the rows by batches, one column at a time
+		reader->set_max_fields( needed_fields() );
+		csv_batch batch( inv_indexes.size() );
+		std::vector<char> show( batch.max_rows );
+		while ( reader->read_batch( &batch ) )
 		{
-			char *line = NULL;
-			unsigned f_off = 0, f_len = 0;
-			unsigned idx_in = 0;
-			bool show = false;
+			std::fill( show.begin(), show.end(), 0 );
 
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			for ( unsigned idx_in = 0 ; idx_in < inv_indexes.size() ; ++idx_in )
 			{
-				if ( ( idx_in < inv_indexes.size() ) && ( inv_indexes[ idx_in ].size() ) )
+				if ( ! inv_indexes[ idx_in ].size() )
+					continue;
+
+				for ( unsigned r = 0 ; r < batch.rows ; ++r )
 				{
-					std::string str;
-					char *ptr = line + f_off;
-					unsigned len = f_len;
-					reader->unescape_csv_field( &ptr, &len, &str );
+					if ( show[ r ] || idx_in >= batch.field_count[ r ] )
+						continue;
 
-					for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
+					// unescaped in place, or in the reader scratch memory for fields with escaped quotes
+					char *ptr = batch.field( idx_in, r );
+					unsigned len = batch.length( idx_in, r );
+					if ( ! batch.quote_free )
+						reader->unescape_csv_field( &ptr, &len );
+
+					if ( col_lits[ idx_in ].size() && ! has_literal( ptr, len, col_lits[ idx_in ] ) )
+						continue;
+
+					if ( col_dfa[ idx_in ] && col_dfa[ idx_in ]->match( ptr, len ) )
 					{
-						unsigned idx_g = inv_indexes[ idx_in ][ i ];
-						if ( idx_g < vals.size() && regexec( &vals_re[ idx_g ], str.c_str(), 0, NULL, 0 ) != REG_NOMATCH )
-							show = true;
+						show[ r ] = 1;
+						continue;
+					}
+
+					for ( unsigned i = 0 ; i < col_re[ idx_in ].size() ; ++i )
+					{
+						if ( regexec_field( &vals_re[ col_re[ idx_in ][ i ] ], ptr, len ) )
+						{
+							show[ r ] = 1;
+							break;
+						}
 					}
 				}
-				++idx_in;
 			}
 
-			if ( show ^ invert )
+			for ( unsigned r = 0 ; r < batch.rows ; ++r )
 			{
-				outbuf->append( line, f_off + f_len );
-				outbuf->append_nl();
-				++stats_match;
-			}
-			++stats_seen;
+				if ( show[ r ] ^ invert )
+				{
+					outbuf->append( batch.row_start[ r ], batch.row_length[ r ] );
+					outbuf->append_nl();
+					++stats_match;
+				}
+				++stats_seen;
 
-			// manually flush if output is sparse
-			if ( stats_seen > stats_batch_size )
-			{
-				if ( ( stats_match > 0 ) && ( stats_match < stats_batch_size / 8 ) )
-					outbuf->flush();
-				stats_seen = 0;
-				// ensure we'll flush next time if we didnt now and next is empty
-				stats_match = ( ( stats_match >= stats_batch_size / 8 ) ? 1 : 0 );
+				// manually flush if output is sparse
+				if ( stats_seen > stats_batch_size )
+				{
+					if ( ( stats_match > 0 ) && ( stats_match < stats_batch_size / 8 ) )
+						outbuf->flush();
+					stats_seen = 0;
+					// ensure we'll flush next time if we didnt now and next is empty
+					stats_match = ( ( stats_match >= stats_batch_size / 8 ) ? 1 : 0 );
+				}
 			}
+		}
 
-		} while ( reader->fetch_line() );
+		for ( unsigned i = 0 ; i < col_dfa.size() ; ++i )
+			delete col_dfa[ i ];
 
 		for ( unsigned i = 0 ; i < vals.size() ; ++i )
 			regfree( &vals_re[ i ] );
@@ -860,7 +1074,7 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_csv_field( (*headers)[i], sep_out, quot );
 			}
 
 			outbuf->append_nl();
@@ -951,11 +1165,11 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_csv_field( (*headers)[i], sep_out, quot );
 			}
 
 			outbuf->append( sep_out );
-			outbuf->append( reader->escape_csv_field( "concat" ) );
+			outbuf->append( "concat", 6 );
 
 			outbuf->append_nl();
 		}
@@ -991,7 +1205,7 @@ public:
 			for ( unsigned i = 0 ; i < indexes.size() ; ++i )
 				if ( indexes[ i ] != -1 )
 					ccat += flds[ indexes[ i ] ];
-			outbuf->append( reader->escape_csv_field( ccat ) );
+			outbuf->append_csv_field( ccat, sep_out, quot );
 
 			outbuf->append_nl();
 		} while ( reader->fetch_line() );
@@ -1010,15 +1224,18 @@ public:
 			return;
 
 		unsigned long lineno = 0;
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
 		do
 		{
-			outbuf->append( ull_str( lineno++, "%03lu:" ) );
+			char lbuf[ 24 ];
+			const unsigned lbuf_len = format_ull( lbuf, lineno++, 3 );
+			lbuf[ lbuf_len ] = ':';
+			outbuf->append( lbuf, lbuf_len + 1 );
 
 			// parse input row
-			char *fld = NULL;
-			unsigned f_len = 0;
-			unsigned colnum = 0;
-			while ( reader->read_csv_field( &fld, &f_len ) )
+			const unsigned n_fields = reader->read_row( &line, &f_off, &f_len );
+			for ( unsigned colnum = 0 ; colnum < n_fields ; ++colnum )
 			{
 				// create & populate headers ondemand
 				if ( ! headers )
@@ -1032,8 +1249,7 @@ public:
 
 				outbuf->append( headers->at( colnum ) );
 				outbuf->append( '=' );
-				outbuf->append( fld, f_len );
-				++colnum;
+				outbuf->append( line + f_off[ colnum ], f_len[ colnum ] );
 			}
 			outbuf->append_nl();
 
@@ -1055,7 +1271,7 @@ public:
 		{
 			for ( unsigned i = 0 ; i < headers->size() ; ++i )
 			{
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_csv_field( (*headers)[i], sep_out, quot );
 
 				if ( i + 1 < headers->size() )
 					outbuf->append( sep_out );
@@ -1093,24 +1309,68 @@ public:
 
 		unsigned long lineno = 0;
 
-		do
+		// jump to the closest indexed row (see index)
+		const unsigned long header_rows = ( headers ? 1 : 0 );
+		row_index index;
+		if ( lineno_min > 0 && filename && index.load( filename, sep, quot ) )
 		{
-			char *fld = NULL;
-			unsigned fld_len = 0;
-			unsigned colnum = 0;
+			const row_checkpoint *cp = index.find( lineno_min + header_rows );
+			if ( cp && cp->row > header_rows && reader->seek( *cp ) )
+			{
+				lineno = cp->row - header_rows;
+				if ( ! reader->fetch_line() )
+					return;
+			}
+		}
+
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
 
-			while ( reader->read_csv_field( &fld, &fld_len ) )
+		// open-ended range of a mapped file: stretches of rows that would be output unchanged are copied from the input file
+		// by the kernel, the other rows are parsed as usual
+		int in_fd = -1;
+		const char *in_data = NULL;
+		uint64_t in_size = 0;
+		const bool passthrough = ( lineno_max == (unsigned long)-1 && sep_out == sep && reader->mapped_input( &in_fd, &in_data, &in_size ) );
+		uint64_t passthrough_retry = 0;
+
+		do
+		{
+			if ( passthrough && lineno >= lineno_min && reader->row_offset() >= passthrough_retry )
 			{
-				if ( lineno >= lineno_min )
+				const uint64_t off = reader->row_offset();
+				const size_t scan_len = ( in_size - off > passthrough_chunk ? passthrough_chunk : in_size - off );
+				size_t stop;
+				const size_t len = plain_crlf_rows( in_data + off, scan_len, quot, &stop );
+
+				if ( len >= passthrough_min )
 				{
-					if ( colnum++ > 0 )
-						outbuf->append( sep_out );
-					outbuf->append( fld, fld_len );
+					outbuf->append_file( in_fd, off, in_data + off, len );
+
+					// fetch_line() returns the row after the copied ones
+					if ( ! reader->seek( off + len ) )
+						return;
+
+					continue;
 				}
+
+				// parse the rows up to the first byte that needs it, and at least passthrough_min bytes (eg \n line ends)
+				passthrough_retry = off + ( stop < passthrough_min ? passthrough_min : stop + 1 );
 			}
 
+			const unsigned n_fields = reader->read_row( &line, &f_off, &f_len );
+
 			if ( lineno >= lineno_min )
+			{
+				for ( unsigned colnum = 0 ; colnum < n_fields ; ++colnum )
+				{
+					if ( colnum > 0 )
+						outbuf->append( sep_out );
+					outbuf->append( line + f_off[ colnum ], f_len[ colnum ] );
+				}
+
 				outbuf->append_nl();
+			}
 
 			++lineno;
 
@@ -1121,6 +1381,21 @@ public:
 	}
 
 
+	// build the sidecar row index of a file, used by rows() to skip the beginning of the file and by -j to split the file
+	void index ( const char *filename )
+	{
+		if ( ! filename )
+		{
+			std::cerr << "Cannot index stdin" << std::endl;
+			return;
+		}
+
+		row_index idx;
+		if ( idx.build( filename, sep, quot ) )
+			idx.save( filename );
+	}
+
+
 	// rename columns, always output a headerline, even with -H
 	void rename ( const std::string &colval, const char *filename )
 	{
@@ -1169,7 +1444,18 @@ public:
 		}
 		outbuf->append_nl();
 
-		// copy end of file unchanged
+		// copy end of file unchanged, from the current row
+		int in_fd;
+		const char *in_data;
+		uint64_t in_size;
+		if ( ! reader->eos() && reader->mapped_input( &in_fd, &in_data, &in_size ) )
+		{
+			const uint64_t off = reader->row_offset();
+			outbuf->append_file( in_fd, off, in_data + off, in_size - off );
+
+			return;
+		}
+
 		while ( ! reader->eos() )
 		{
 			char *ptr = NULL;
@@ -1195,7 +1481,7 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[ i ] ) );
+				outbuf->append_csv_field( (*headers)[ i ], sep_out, quot );
 			}
 			outbuf->append_nl();
 		}
@@ -1203,46 +1489,63 @@ public:
 		if ( reader->eos() )
 			return;
 
+		char *line = NULL;
+		std::vector<unsigned> f_off, f_len;
+
+		// the fields after the last converted column are copied raw, if the separator is unchanged
+		const unsigned max_fields = ( sep_out == sep ? needed_fields() : 0 );
+		reader->set_max_fields( max_fields );
+
 		do
 		{
-			char *fld = NULL;
-			unsigned fld_len = 0;
-			unsigned colnum = 0;
+			unsigned row_end = 0;
+			const unsigned n_fields = reader->read_row( &line, &f_off, &f_len, &row_end );
 
-			while ( reader->read_csv_field( &fld, &fld_len ) )
+			for ( unsigned colnum = 0 ; colnum < n_fields ; ++colnum )
 			{
+				char *fld = line + f_off[ colnum ];
+				unsigned fld_len = f_len[ colnum ];
+
 				if ( colnum > 0 )
 					outbuf->append( sep_out );
 
-				if ( inv_indexes[ colnum ].size() )
+				if ( colnum < inv_indexes.size() && inv_indexes[ colnum ].size() )
 				{
-					char *fld_dup = fld;
-					unsigned fld_len_dup = fld_len;
-					std::string hex;
-					reader->unescape_csv_field( &fld_dup, &fld_len_dup, &hex );
+					char *num = fld;
+					unsigned num_len = fld_len;
+					reader->unescape_csv_field( &num, &num_len );
 
 					unsigned long long v;
 					int minus = 0;
 
-					if ( hex.size() > 0 && hex[0] == '-' )
+					if ( num_len > 0 && num[0] == '-' )
 					{
 						minus = 1;
-						hex = hex.substr( 1 );
+						++num;
+						--num_len;
 					}
 
-					if ( ! str_ull( hex, &v ) )
+					if ( ! str_ull( num, num_len, &v ) )
 						outbuf->append( fld, fld_len );
 					else
 					{
+						char buf[ 24 ];
+						unsigned buf_len = 0;
 						if ( minus )
-							outbuf->append( '-' );
-						outbuf->append( ull_str( v ) );
+							buf[ buf_len++ ] = '-';
+						buf_len += format_ull( buf + buf_len, v );
+						outbuf->append( buf, buf_len );
 					}
 				}
 				else
 					outbuf->append( fld, fld_len );
+			}
 
-				++colnum;
+			// skipped fields, starting with their separator
+			if ( reader->skipped_field_count() && n_fields > 0 )
+			{
+				const unsigned tail = f_off[ n_fields - 1 ] + f_len[ n_fields - 1 ];
+				outbuf->append( line + tail, row_end - tail );
 			}
 
 			outbuf->append_nl();
@@ -1257,6 +1560,9 @@ static const char *usage =
 "          -V                 display version information and exit\n"
 "          -h                 display help (this text) and exit\n"
 "          -o <outfile>       specify output file (default=stdout)\n"
+"          -D                 write the output file with O_DIRECT (bypass the page cache), for huge outputs\n"
+"          -z <format>        compress the output with gzip or zstd, using one thread per cpu\n"
+"                             (default: from the outfile extension, .gz or .zst)\n"
 "          -s <separator>     csv field separator (default=',')\n"
 "          -S <separator>     output csv field separator (default=sep) - do not use -s after this option ; ignored in rename\n"
 "          -q <quote>         csv quote character (default='\"')\n"
@@ -1268,6 +1574,9 @@ static const char *usage =
 "          -u                 unique columns: do not include cols specified in colspec when expanding ranges\n"
 "                             useful to move cols, eg select -u col3,-,col1\n"
 "          -0                 in extract mode, end records with a nul byte\n"
+"          -j <threads>       split regular input files in chunks parsed by many threads (select, deselect, extract)\n"
+"                             0 = one thread per cpu\n"
+"          -R                 read inputs from a background thread (no mmap), for slow storage\n"
 "\n"
 "csv addcol <col1>=<val1>,..  prepend a column to the csv with fixed value\n"
 "csv extract <column>         extract one column data\n"
@@ -1283,6 +1592,7 @@ static const char *usage =
 "csv concat <col1>,<col2>,... add a column with the concatenation of the specified columns\n"
 "csv rows <min>-<max>         dump selected row range from file\n"
 "csv stripheader              dump the csv files omitting the header line\n"
+"csv index <files>            build a row index of files (<file>.csvidx), used by rows to skip directly to the selected rows\n"
 "csv decimal <cols>           convert selected columns to decimal int64 representation\n"
 ;
 
@@ -1319,13 +1629,16 @@ int main ( int argc, char * argv[] )
 {
 	int opt;
 	char *outfile = NULL;
+	bool out_direct = false;
+	const char *out_compress = NULL;
 	char sep = ',';
 	char sep_out = ',';
 	char quot = '"';
 	unsigned line_max = 64*1024;
 	unsigned csv_flags = 0;
+	unsigned nthreads = 1;
 
-	while ( (opt = getopt(argc, argv, "hVo:s:S:q:L:Hivu0")) != -1 )
+	while ( (opt = getopt(argc, argv, "hVo:Dz:s:S:q:L:Hivu0j:R")) != -1 )
 	{
 		switch (opt)
 		{
@@ -1341,6 +1654,14 @@ int main ( int argc, char * argv[] )
 			outfile = optarg;
 			break;
 
+		case 'D':
+			out_direct = true;
+			break;
+
+		case 'z':
+			out_compress = optarg;
+			break;
+
 		case 's':
 			sep = *optarg;
 			if ( sep == '\\' )
@@ -1384,6 +1705,16 @@ int main ( int argc, char * argv[] )
 			csv_flags |= 1 << EXTRACT_ZERO;
 			break;
 
+		case 'j':
+			nthreads = strtoul( optarg, NULL, 0 );
+			if ( nthreads == 0 )
+				nthreads = sysconf( _SC_NPROCESSORS_ONLN );
+			break;
+
+		case 'R':
+			csv_flags |= 1 << READAHEAD;
+			break;
+
 		default:
 			std::cerr << "Unknwon option: " << opt << std::endl << usage << std::endl;
 			return EXIT_FAILURE;
@@ -1396,11 +1727,19 @@ int main ( int argc, char * argv[] )
 		return EXIT_FAILURE;
 	}
 
-	output_buffer outbuf( outfile );
+	int compress = ( out_compress ? output_buffer::compression_by_name( out_compress ) : output_buffer::compression_for_file( outfile ) );
+	if ( compress < 0 )
+	{
+		std::cerr << "Unsupported output compression" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// write from a background thread, with up to 3 buffers of 4MB
+	output_buffer outbuf( outfile, 4*1024*1024, out_direct, 3, compress );
 	if ( outbuf.failed_to_open() )
 		return EXIT_FAILURE;
 
-	csv_tool csv( &outbuf, sep, sep_out, quot, line_max, csv_flags );
+	csv_tool csv( &outbuf, sep, sep_out, quot, line_max, csv_flags, nthreads );
 
 	std::string mode = argv[optind++];
 
@@ -1588,6 +1927,17 @@ int main ( int argc, char * argv[] )
 				csv.rows( "1-", argv[ i ] );
 		}
 	}
+	else if ( mode == "index" )
+	{
+		if ( optind >= argc )
+		{
+			std::cerr << "No input file specified" << std::endl << usage << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		for ( int i = optind ; i < argc ; ++i )
+			csv.index( argv[ i ] );
+	}
 	else if ( mode == "decimal" || mode == "dec" )
 	{
 		if ( optind >= argc )
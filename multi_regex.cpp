@@ -0,0 +1,905 @@
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+
+#include "multi_regex.h"
+
+// NFA size limit (bounded repetitions are expanded), patterns needing more nodes are left to regexec
+static const unsigned max_nfa_nodes = 16384;
+
+// largest bound of a {n,m} repetition
+static const int max_repeat = 255;
+
+// nested parentheses limit
+static const unsigned max_depth = 256;
+
+// DFA cache size, in states: the cache is emptied when it is full
+static const unsigned max_dfa_states = 4096;
+
+// a piece of NFA: entry node, exit node (whose out is not set yet), and first node created for it
+// all the nodes of a piece are allocated after first, and only point to nodes of the piece (except the exit)
+struct nfa_frag {
+	int first;
+	int start;
+	int end;
+};
+
+// recursive descent parser of a POSIX extended regular expression, appending to the NFA of a multi_regex
+class multi_regex::parser
+{
+private:
+	multi_regex *re;
+	const std::string &pat;
+	size_t pos;
+
+	bool at ( const char c ) const
+	{
+		return pos < pat.size() && pat[ pos ] == c;
+	}
+
+	// new piece made of a single node
+	nfa_frag single ( const int type, const int set = -1 )
+	{
+		nfa_frag f;
+		f.first = f.start = f.end = re->new_node( type, -1, -1, set );
+		return f;
+	}
+
+	void link ( const nfa_frag &f, const int to )
+	{
+		re->nfa[ f.end ].out = to;
+	}
+
+	// append g after f
+	void concat ( nfa_frag *f, const nfa_frag &g )
+	{
+		link( *f, g.start );
+		f->end = g.end;
+	}
+
+	int new_charset ( )
+	{
+		charset cs;
+		memset( &cs, 0, sizeof(cs) );
+		re->charsets.push_back( cs );
+
+		return re->charsets.size() - 1;
+	}
+
+	void charset_add ( const int set, const unsigned char c )
+	{
+		re->charsets[ set ].bits[ c >> 5 ] |= 1U << ( c & 31 );
+	}
+
+	// with REG_ICASE, a set holding a letter also holds the other case
+	void charset_fold ( const int set )
+	{
+		if ( ! re->icase )
+			return;
+
+		for ( unsigned c = 0 ; c < 256 ; ++c )
+			if ( re->charset_has( set, c ) )
+			{
+				charset_add( set, tolower( c ) );
+				charset_add( set, toupper( c ) );
+			}
+	}
+
+	// copy the nodes [f.first, last] of a piece
+	nfa_frag copy ( const nfa_frag &f, const int last )
+	{
+		const int delta = re->nfa.size() - f.first;
+
+		for ( int i = f.first ; i <= last ; ++i )
+		{
+			nfa_node n = re->nfa[ i ];
+			if ( n.out >= f.first && n.out <= last )
+				n.out += delta;
+			if ( n.out2 >= f.first && n.out2 <= last )
+				n.out2 += delta;
+			re->nfa.push_back( n );
+		}
+
+		nfa_frag c;
+		c.first = f.first + delta;
+		c.start = f.start + delta;
+		c.end = f.end + delta;
+
+		return c;
+	}
+
+	// apply a {min,max} repetition to a piece (max < 0: no upper bound)
+	bool repeat ( nfa_frag *f, const int min, const int max )
+	{
+		if ( min == 1 && max == 1 )
+			return true;
+
+		const int last = re->nfa.size() - 1;
+
+		// instances of the piece (copies are made before the original is linked)
+		int count = ( max < 0 ? std::max( min, 1 ) : max );
+		if ( (unsigned)( ( last - f->first + 1 ) * count + 4 * count ) + re->nfa.size() > max_nfa_nodes )
+			return false;
+
+		std::vector< nfa_frag > parts( 1, *f );
+		for ( int i = 1 ; i < count ; ++i )
+			parts.push_back( copy( *f, last ) );
+
+		nfa_frag r = single( NFA_EMPTY );
+		r.first = f->first;
+
+		for ( int i = 0 ; i < min ; ++i )
+			concat( &r, parts[ i ] );
+
+		if ( max < 0 )
+		{
+			nfa_frag &p = parts[ count - 1 ];
+			const int exit = re->new_node( NFA_EMPTY );
+			const int split = re->new_node( NFA_SPLIT, p.start, exit );
+			link( p, split );
+
+			if ( min == 0 )
+				link( r, split );
+			r.end = exit;
+		}
+		else
+		{
+			// optional instances: x?x?...
+			for ( int i = min ; i < max ; ++i )
+			{
+				const int exit = re->new_node( NFA_EMPTY );
+				const int split = re->new_node( NFA_SPLIT, parts[ i ].start, exit );
+				link( parts[ i ], exit );
+				link( r, split );
+				r.end = exit;
+			}
+		}
+
+		*f = r;
+
+		return true;
+	}
+
+	// read the number of a {n,m} bound
+	bool number ( int *n )
+	{
+		if ( pos >= pat.size() || ! isdigit( (unsigned char)pat[ pos ] ) )
+			return false;
+
+		*n = 0;
+		while ( pos < pat.size() && isdigit( (unsigned char)pat[ pos ] ) )
+		{
+			*n = *n * 10 + ( pat[ pos++ ] - '0' );
+			if ( *n > max_repeat )
+				return false;
+		}
+
+		return true;
+	}
+
+	// [...] bracket expression, pos after the [
+	bool bracket ( int *set )
+	{
+		*set = new_charset();
+
+		bool negate = false;
+		if ( at( '^' ) )
+		{
+			negate = true;
+			++pos;
+		}
+
+		for ( bool first = true ; ; first = false )
+		{
+			if ( pos >= pat.size() )
+				return false;
+
+			const unsigned char c = pat[ pos ];
+			if ( c == ']' && ! first )
+			{
+				++pos;
+				break;
+			}
+
+			if ( c == '[' && pos + 1 < pat.size() )
+			{
+				const char kind = pat[ pos + 1 ];
+
+				// collating element or equivalence class
+				if ( kind == '.' || kind == '=' )
+					return false;
+
+				if ( kind == ':' )
+				{
+					const size_t end = pat.find( ":]", pos + 2 );
+					if ( end == std::string::npos )
+						return false;
+
+					const std::string name = pat.substr( pos + 2, end - pos - 2 );
+					int (*is)( int ) = NULL;
+					if ( name == "alpha" ) is = isalpha;
+					else if ( name == "digit" ) is = isdigit;
+					else if ( name == "alnum" ) is = isalnum;
+					else if ( name == "upper" ) is = isupper;
+					else if ( name == "lower" ) is = islower;
+					else if ( name == "space" ) is = isspace;
+					else if ( name == "blank" ) is = isblank;
+					else if ( name == "punct" ) is = ispunct;
+					else if ( name == "print" ) is = isprint;
+					else if ( name == "graph" ) is = isgraph;
+					else if ( name == "cntrl" ) is = iscntrl;
+					else if ( name == "xdigit" ) is = isxdigit;
+					else
+						return false;
+
+					for ( unsigned b = 0 ; b < 256 ; ++b )
+						if ( is( b ) )
+							charset_add( *set, b );
+
+					pos = end + 2;
+					continue;
+				}
+			}
+
+			++pos;
+
+			if ( pos + 1 < pat.size() && pat[ pos ] == '-' && pat[ pos + 1 ] != ']' )
+			{
+				// range, only for ascii bytes (the order of other bytes depends on the collation)
+				const unsigned char hi = pat[ pos + 1 ];
+				if ( hi == '[' || hi < c || hi >= 0x80 )
+					return false;
+
+				for ( unsigned b = c ; b <= hi ; ++b )
+					charset_add( *set, b );
+
+				pos += 2;
+			}
+			else
+				charset_add( *set, c );
+		}
+
+		charset_fold( *set );
+
+		if ( negate )
+			for ( unsigned i = 0 ; i < 8 ; ++i )
+				re->charsets[ *set ].bits[ i ] = ~re->charsets[ *set ].bits[ i ];
+
+		return true;
+	}
+
+	// single character, group, bracket or anchor
+	bool atom ( nfa_frag *f, const unsigned depth, const bool branch_start, bool *anchor )
+	{
+		*anchor = false;
+		const unsigned char c = pat[ pos ];
+
+		switch ( c )
+		{
+		case '(':
+			++pos;
+			if ( depth >= max_depth || ! alternation( f, depth + 1 ) || ! at( ')' ) )
+				return false;
+			++pos;
+			return true;
+
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			// repetition of nothing
+			return false;
+
+		case '^':
+		case '$':
+			// glibc lets anchors inside a pattern match next to a newline: only handle ^ starting and $ ending a
+			// top-level branch, which are plain start / end of the string
+			++pos;
+			if ( depth > 0 || ( c == '^' ? ! branch_start : pos < pat.size() && pat[ pos ] != '|' ) )
+				return false;
+			*f = single( c == '^' ? NFA_BOL : NFA_EOL );
+			*anchor = true;
+			return true;
+
+		case '.':
+		{
+			++pos;
+			const int set = new_charset();
+			memset( re->charsets[ set ].bits, 0xff, sizeof(re->charsets[ set ].bits) );
+			*f = single( NFA_CHAR, set );
+			return true;
+		}
+
+		case '[':
+		{
+			++pos;
+			int set;
+			if ( ! bracket( &set ) )
+				return false;
+			*f = single( NFA_CHAR, set );
+			return true;
+		}
+
+		case '\\':
+			// only escaped special characters, other escapes are back-references or GNU operators
+			if ( pos + 1 >= pat.size() || ! strchr( "^.[]$()|*+?{}\\", pat[ pos + 1 ] ) )
+				return false;
+			++pos;
+			break;
+		}
+
+		const int set = new_charset();
+		charset_add( set, pat[ pos++ ] );
+		charset_fold( set );
+		*f = single( NFA_CHAR, set );
+
+		return true;
+	}
+
+	// atom followed by repetitions
+	bool piece ( nfa_frag *f, const unsigned depth, const bool branch_start )
+	{
+		bool anchor;
+		if ( ! atom( f, depth, branch_start, &anchor ) )
+			return false;
+
+		while ( pos < pat.size() )
+		{
+			int min, max;
+			switch ( pat[ pos ] )
+			{
+			case '*': min = 0; max = -1; ++pos; break;
+			case '+': min = 1; max = -1; ++pos; break;
+			case '?': min = 0; max = 1; ++pos; break;
+			case '{':
+				++pos;
+				if ( ! number( &min ) )
+					return false;
+				max = min;
+				if ( at( ',' ) )
+				{
+					++pos;
+					max = -1;
+					if ( ! at( '}' ) && ! number( &max ) )
+						return false;
+				}
+				if ( ! at( '}' ) || ( max >= 0 && max < min ) )
+					return false;
+				++pos;
+				break;
+			default:
+				return true;
+			}
+
+			if ( anchor || ! repeat( f, min, max ) )
+				return false;
+		}
+
+		return true;
+	}
+
+	// sequence of pieces, may be empty
+	bool branch ( nfa_frag *f, const unsigned depth )
+	{
+		*f = single( NFA_EMPTY );
+
+		while ( pos < pat.size() && pat[ pos ] != '|' && pat[ pos ] != ')' )
+		{
+			nfa_frag g;
+			if ( ! piece( &g, depth, f->start == f->end ) )
+				return false;
+
+			concat( f, g );
+
+			if ( re->nfa.size() > max_nfa_nodes )
+				return false;
+		}
+
+		return true;
+	}
+
+	// branches separated by |
+	bool alternation ( nfa_frag *f, const unsigned depth )
+	{
+		if ( ! branch( f, depth ) )
+			return false;
+
+		while ( at( '|' ) )
+		{
+			++pos;
+
+			nfa_frag g;
+			if ( ! branch( &g, depth ) )
+				return false;
+
+			const int exit = re->new_node( NFA_EMPTY );
+			f->start = re->new_node( NFA_SPLIT, f->start, g.start );
+			link( *f, exit );
+			link( g, exit );
+			f->end = exit;
+		}
+
+		return true;
+	}
+
+public:
+	explicit parser ( multi_regex *re, const std::string &pat ) :
+		re(re),
+		pat(pat),
+		pos(0)
+	{
+	}
+
+	// parse the whole pattern, return false if the syntax is not supported
+	bool parse ( nfa_frag *f )
+	{
+		return alternation( f, 0 ) && pos == pat.size();
+	}
+};
+
+
+multi_regex::multi_regex ( const bool icase ) :
+	icase(icase),
+	compiled(false),
+	root(-1),
+	n_classes(0),
+	start_state(DFA_UNKNOWN),
+	visit_mark(0)
+{
+	// node 0: end of all the patterns
+	new_node( NFA_MATCH );
+}
+
+multi_regex::~multi_regex ( )
+{
+}
+
+int multi_regex::new_node ( const int type, const int out, const int out2, const int set )
+{
+	nfa_node n;
+	n.type = type;
+	n.out = out;
+	n.out2 = out2;
+	n.set = set;
+	nfa.push_back( n );
+
+	return nfa.size() - 1;
+}
+
+bool multi_regex::charset_has ( const int set, const unsigned char c ) const
+{
+	return ( charsets[ set ].bits[ c >> 5 ] >> ( c & 31 ) ) & 1;
+}
+
+bool multi_regex::add ( const std::string &pattern )
+{
+	const size_t nfa_size = nfa.size();
+	const size_t charsets_size = charsets.size();
+
+	parser p( this, pattern );
+	nfa_frag f;
+	if ( ! p.parse( &f ) )
+	{
+		nfa.resize( nfa_size );
+		charsets.resize( charsets_size );
+
+		return false;
+	}
+
+	nfa[ f.end ].out = 0;
+	patterns.push_back( f.start );
+	compiled = false;
+
+	return true;
+}
+
+unsigned multi_regex::size ( ) const
+{
+	return patterns.size();
+}
+
+void multi_regex::compile ( )
+{
+	compiled = true;
+
+	root = ( patterns.empty() ? -1 : patterns[ 0 ] );
+	for ( unsigned i = 1 ; i < patterns.size() ; ++i )
+		root = new_node( NFA_SPLIT, patterns[ i ], root );
+
+	// byte classes: split the bytes by membership of each charset, the nul byte (end of string for regexec) apart
+	memset( byte_class, 0, sizeof(byte_class) );
+	byte_class[ 0 ] = 1;
+	n_classes = 2;
+	for ( unsigned s = 0 ; s < charsets.size() ; ++s )
+	{
+		int remap[ 256 ][ 2 ];
+		memset( remap, -1, sizeof(remap) );
+
+		unsigned n = 0;
+		for ( unsigned b = 0 ; b < 256 ; ++b )
+		{
+			int &to = remap[ byte_class[ b ] ][ charset_has( s, b ) ];
+			if ( to < 0 )
+				to = n++;
+			byte_class[ b ] = to;
+		}
+		n_classes = n;
+	}
+
+	class_byte.assign( n_classes, 0 );
+	for ( unsigned b = 256 ; b-- > 0 ; )
+		class_byte[ byte_class[ b ] ] = b;
+
+	visited.assign( nfa.size(), 0 );
+	visit_mark = 0;
+
+	restart.clear();
+	if ( root >= 0 )
+	{
+		new_visit();
+		closure( &restart, root, false, false );
+		std::sort( restart.begin(), restart.end() );
+	}
+
+	reset_states();
+}
+
+void multi_regex::new_visit ( )
+{
+	if ( ++visit_mark == 0 )
+	{
+		std::fill( visited.begin(), visited.end(), 0 );
+		visit_mark = 1;
+	}
+}
+
+void multi_regex::closure ( std::vector< int > *set, const int node, const bool at_start, const bool at_end )
+{
+	stack.push_back( node );
+
+	while ( ! stack.empty() )
+	{
+		const int n = stack.back();
+		stack.pop_back();
+
+		if ( visited[ n ] == visit_mark )
+			continue;
+		visited[ n ] = visit_mark;
+
+		const nfa_node &nn = nfa[ n ];
+		switch ( nn.type )
+		{
+		case NFA_CHAR:
+		case NFA_MATCH:
+			set->push_back( n );
+			break;
+		case NFA_SPLIT:
+			stack.push_back( nn.out2 );
+			stack.push_back( nn.out );
+			break;
+		case NFA_EMPTY:
+			stack.push_back( nn.out );
+			break;
+		case NFA_BOL:
+			if ( at_start )
+				stack.push_back( nn.out );
+			break;
+		case NFA_EOL:
+			if ( at_end )
+				stack.push_back( nn.out );
+			else
+				set->push_back( n );
+			break;
+		}
+	}
+}
+
+void multi_regex::reset_states ( )
+{
+	states.clear();
+	state_ids.clear();
+	trans.clear();
+	start_state = DFA_UNKNOWN;
+}
+
+int multi_regex::find_state ( std::vector< int > *nodes, const bool at_start )
+{
+	if ( nodes->empty() )
+		return DFA_DEAD;
+
+	std::sort( nodes->begin(), nodes->end() );
+	// node 0 is the match node
+	if ( (*nodes)[ 0 ] == 0 )
+		return DFA_MATCH;
+
+	std::pair< bool, std::vector< int > > key( at_start, *nodes );
+	std::map< std::pair< bool, std::vector< int > >, int >::iterator it = state_ids.find( key );
+	if ( it != state_ids.end() )
+		return it->second;
+
+	if ( states.size() >= max_dfa_states )
+		reset_states();
+
+	dfa_state st;
+	st.nodes.swap( *nodes );
+	st.at_start = at_start;
+
+	// match if the string ends here: cross the NFA_EOL nodes
+	std::vector< int > end_nodes;
+	new_visit();
+	for ( unsigned i = 0 ; i < st.nodes.size() ; ++i )
+		if ( nfa[ st.nodes[ i ] ].type == NFA_EOL )
+			closure( &end_nodes, st.nodes[ i ], at_start, true );
+	st.accept_end = ( std::find( end_nodes.begin(), end_nodes.end(), 0 ) != end_nodes.end() );
+
+	const int id = states.size();
+	states.push_back( st );
+	state_ids[ key ] = id;
+	trans.resize( trans.size() + n_classes, DFA_UNKNOWN );
+
+	return id;
+}
+
+int multi_regex::step ( const int s, const unsigned cls )
+{
+	const unsigned char b = class_byte[ cls ];
+	int next;
+
+	if ( b == 0 )
+	{
+		// regexec stops at a nul byte
+		next = ( states[ s ].accept_end ? DFA_MATCH : DFA_DEAD );
+	}
+	else
+	{
+		std::vector< int > nodes;
+
+		new_visit();
+		const std::vector< int > &cur = states[ s ].nodes;
+		for ( unsigned i = 0 ; i < cur.size() ; ++i )
+		{
+			const nfa_node &nn = nfa[ cur[ i ] ];
+			if ( nn.type == NFA_CHAR && charset_has( nn.set, b ) )
+				closure( &nodes, nn.out, false, false );
+		}
+
+		// a match may start at the next byte
+		for ( unsigned i = 0 ; i < restart.size() ; ++i )
+			if ( visited[ restart[ i ] ] != visit_mark )
+				nodes.push_back( restart[ i ] );
+
+		const size_t n_states = states.size();
+		next = find_state( &nodes, false );
+
+		// the cache was emptied, s is gone
+		if ( states.size() < n_states )
+			return next;
+	}
+
+	trans[ s * n_classes + cls ] = next;
+
+	return next;
+}
+
+bool multi_regex::match ( const char *s, const size_t len )
+{
+	if ( ! compiled )
+		compile();
+
+	if ( root < 0 )
+		return false;
+
+	if ( start_state == DFA_UNKNOWN )
+	{
+		std::vector< int > nodes;
+		new_visit();
+		closure( &nodes, root, true, false );
+		start_state = find_state( &nodes, true );
+	}
+
+	int st = start_state;
+	if ( st == DFA_MATCH )
+		return true;
+	if ( st == DFA_DEAD )
+		return false;
+
+	const unsigned char *p = (const unsigned char *)s;
+	const int *t = &trans[ 0 ];
+	for ( size_t i = 0 ; i < len ; ++i )
+	{
+		const unsigned cls = byte_class[ p[ i ] ];
+		int next = t[ st * n_classes + cls ];
+
+		if ( next < 0 )
+		{
+			if ( next == DFA_UNKNOWN )
+			{
+				next = step( st, cls );
+				t = &trans[ 0 ];
+			}
+
+			if ( next == DFA_MATCH )
+				return true;
+			if ( next == DFA_DEAD )
+				return false;
+		}
+
+		st = next;
+	}
+
+	return states[ st ].accept_end;
+}
+
+
+// return the offset after the bracket expression starting at i, npos if it does not end
+static size_t skip_bracket ( const std::string &pat, size_t i )
+{
+	++i;
+	if ( i < pat.size() && pat[ i ] == '^' )
+		++i;
+	if ( i < pat.size() && pat[ i ] == ']' )
+		++i;
+
+	while ( i < pat.size() && pat[ i ] != ']' )
+	{
+		if ( pat[ i ] == '[' && i + 1 < pat.size() && strchr( ":.=", pat[ i + 1 ] ) )
+		{
+			const char end[] = { pat[ i + 1 ], ']', 0 };
+			i = pat.find( end, i + 2 );
+			if ( i == std::string::npos )
+				return i;
+			i += 2;
+		}
+		else
+			++i;
+	}
+
+	return ( i < pat.size() ? i + 1 : std::string::npos );
+}
+
+// return the offset after the group starting at i, npos if it does not end
+static size_t skip_group ( const std::string &pat, size_t i )
+{
+	unsigned depth = 0;
+
+	while ( i < pat.size() )
+	{
+		switch ( pat[ i ] )
+		{
+		case '\\':
+			i += 2;
+			break;
+		case '[':
+			i = skip_bracket( pat, i );
+			break;
+		case '(':
+			++depth;
+			++i;
+			break;
+		case ')':
+			++i;
+			if ( --depth == 0 )
+				return i;
+			break;
+		default:
+			++i;
+		}
+	}
+
+	return std::string::npos;
+}
+
+bool multi_regex::required_literals ( const std::string &pat, std::vector< std::string > *lits )
+{
+	// longest run of mandatory characters of the current branch, and the run being read
+	std::string best, run;
+	size_t i = 0;
+
+	for ( ; ; )
+	{
+		if ( i >= pat.size() || pat[ i ] == '|' )
+		{
+			if ( run.size() > best.size() )
+				best = run;
+			if ( best.empty() )
+				return false;
+
+			lits->push_back( best );
+			if ( i >= pat.size() )
+				return true;
+
+			best.clear();
+			run.clear();
+			++i;
+			continue;
+		}
+
+		// atom: a character of the match, or something else (group, bracket, anchor...)
+		bool literal = false;
+		char lc = 0;
+
+		switch ( pat[ i ] )
+		{
+		case '\\':
+			if ( i + 1 >= pat.size() )
+				return false;
+			// other escapes are back-references and GNU operators
+			if ( strchr( "^.[]$()|*+?{}\\", pat[ i + 1 ] ) )
+			{
+				literal = true;
+				lc = pat[ i + 1 ];
+			}
+			i += 2;
+			break;
+		case '(':
+			i = skip_group( pat, i );
+			break;
+		case '[':
+			i = skip_bracket( pat, i );
+			break;
+		case ')':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			return false;
+		case '.':
+		case '^':
+		case '$':
+			++i;
+			break;
+		default:
+			literal = true;
+			lc = pat[ i++ ];
+		}
+
+		if ( i == std::string::npos )
+			return false;
+
+		// repetition of the atom: optional, or the run ends after one occurrence
+		bool optional = false;
+		bool repeated = false;
+		if ( i < pat.size() )
+		{
+			switch ( pat[ i ] )
+			{
+			case '*':
+			case '?':
+				optional = true;
+				++i;
+				break;
+			case '+':
+				repeated = true;
+				++i;
+				break;
+			case '{':
+				++i;
+				if ( i >= pat.size() || ! isdigit( (unsigned char)pat[ i ] ) )
+					return false;
+				optional = true;
+				for ( ; i < pat.size() && isdigit( (unsigned char)pat[ i ] ) ; ++i )
+					if ( pat[ i ] != '0' )
+						optional = false;
+				repeated = true;
+				i = pat.find( '}', i );
+				if ( i == std::string::npos )
+					return false;
+				++i;
+				break;
+			}
+
+			if ( i < pat.size() && strchr( "*+?{", pat[ i ] ) )
+				return false;
+		}
+
+		if ( literal && ! optional )
+			run.push_back( lc );
+
+		if ( ! literal || optional || repeated )
+		{
+			if ( run.size() > best.size() )
+				best = run;
+			run.clear();
+		}
+	}
+}
@@ -0,0 +1,123 @@
+#ifndef MULTI_REGEX_H
+#define MULTI_REGEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+/*
+ * Match a string against a set of POSIX extended regular expressions in a single pass
+ *
+ * The patterns are compiled together in one NFA (Thompson construction). The NFA is run as a DFA built lazily during
+ * matching: each DFA state is a set of NFA states, created the first time the input leads to it, and its transitions are
+ * cached in a table indexed by byte class (bytes that no pattern tells apart share a class). The DFA only answers
+ * "does any of the patterns match somewhere in the string", as regexec( REG_NOSUB ) for each pattern would, and stops at
+ * the first byte where a match is known. When the DFA grows too large, the cache is emptied and rebuilt as needed.
+ *
+ * Bytes are single characters (C locale). Patterns using syntax that is not a regular language or that this parser does
+ * not handle (back-references, GNU escapes such as \w or \<, collating elements) are refused by add(): the caller should
+ * match them with regexec.
+ */
+class multi_regex
+{
+private:
+	// builds the NFA of a pattern
+	class parser;
+
+	enum {
+		NFA_CHAR,	// consume a byte of charsets[ set ], go to out
+		NFA_SPLIT,	// go to out and out2
+		NFA_EMPTY,	// go to out
+		NFA_BOL,	// only at the start of the string, go to out
+		NFA_EOL,	// only at the end of the string, go to out
+		NFA_MATCH,
+	};
+
+	struct nfa_node {
+		int type;
+		int out;
+		int out2;
+		int set;
+	};
+
+	struct charset {
+		uint32_t bits[ 8 ];
+	};
+
+	// special transition targets (states are numbered from 0)
+	enum {
+		DFA_UNKNOWN = -1,	// transition not computed yet
+		DFA_MATCH = -2,		// a pattern matched
+		DFA_DEAD = -3,		// no pattern can match anymore
+	};
+
+	struct dfa_state {
+		// sorted NFA_CHAR, NFA_EOL and NFA_MATCH nodes reached
+		std::vector< int > nodes;
+		// start state: NFA_BOL nodes could be crossed
+		bool at_start;
+		// a pattern matches if the string ends here
+		bool accept_end;
+	};
+
+	bool icase;
+	std::vector< nfa_node > nfa;
+	std::vector< charset > charsets;
+	// entry node of each pattern
+	std::vector< int > patterns;
+
+	// the DFA is built from the patterns on the first match() after an add()
+	bool compiled;
+	int root;
+	// nodes reached from root when not at the start of the string, added to every state (unanchored search)
+	std::vector< int > restart;
+	unsigned char byte_class[ 256 ];
+	// a byte of each class
+	std::vector< unsigned char > class_byte;
+	unsigned n_classes;
+	std::vector< dfa_state > states;
+	std::map< std::pair< bool, std::vector< int > >, int > state_ids;
+	// states.size() * n_classes
+	std::vector< int > trans;
+	int start_state;
+	// scratch space for closure()
+	std::vector< unsigned > visited;
+	unsigned visit_mark;
+	std::vector< int > stack;
+
+	int new_node ( const int type, const int out = -1, const int out2 = -1, const int set = -1 );
+	bool charset_has ( const int set, const unsigned char c ) const;
+
+	void compile ( );
+	// start a new set of closure() calls: nodes are visited once per set
+	void new_visit ( );
+	// add the nodes reached from node by empty transitions to set (unsorted)
+	void closure ( std::vector< int > *set, const int node, const bool at_start, const bool at_end );
+	// return the id of the state holding nodes, DFA_MATCH or DFA_DEAD, create it if needed
+	int find_state ( std::vector< int > *nodes, const bool at_start );
+	void reset_states ( );
+	// compute the transition of state s for the bytes of class cls
+	int step ( const int s, const unsigned cls );
+
+public:
+	explicit multi_regex ( const bool icase = false );
+	~multi_regex ( );
+
+	// add a pattern (already checked with regcomp), return false if its syntax is not supported
+	bool add ( const std::string &pattern );
+	// number of patterns added
+	unsigned size ( ) const;
+	// return true if any pattern matches s (len bytes, or up to the first nul byte as regexec)
+	bool match ( const char *s, const size_t len );
+
+	// find for each top-level branch of a pattern a string that is part of all its matches (case sensitive)
+	// return false if a branch has none or the pattern is not understood
+	static bool required_literals ( const std::string &pattern, std::vector< std::string > *lits );
+
+private:
+	multi_regex ( const multi_regex& );
+	multi_regex& operator=( const multi_regex& );
+};
+
+#endif
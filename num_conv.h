@@ -0,0 +1,236 @@
+#ifndef NUM_CONV_H
+#define NUM_CONV_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+/*
+ * Integer formatting and parsing on (pointer, length) strings, without allocation
+ *
+ * Numbers are formatted two digits at a time from a table. Decimal strings are parsed 8 digits at a time (SWAR: the 8
+ * bytes are checked and combined in a 64-bit register) on little-endian hosts, hex strings with a lookup table.
+ * parse_ll() returns the same result as strtoll( s, NULL, 0 ) ; uncommon inputs (octal, hex, leading spaces, overflow)
+ * are handed to strtoll.
+ */
+
+static const char num_conv_digits2[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// value of an hex digit, -1 for other characters
+static const signed char num_conv_hex[ 256 ] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// write the decimal representation of v in out (at least 20 bytes, not nul-terminated), return its length
+// min_digits pads with zeros
+inline unsigned format_ull ( char *out, unsigned long long v, const unsigned min_digits = 1 )
+{
+	char tmp[ 24 ];
+	char *p = tmp + sizeof(tmp);
+
+	while ( v >= 100 )
+	{
+		const unsigned r = v % 100;
+		v /= 100;
+		p -= 2;
+		memcpy( p, num_conv_digits2 + 2*r, 2 );
+	}
+
+	if ( v >= 10 )
+	{
+		p -= 2;
+		memcpy( p, num_conv_digits2 + 2*v, 2 );
+	}
+	else
+		*--p = '0' + v;
+
+	while ( p > tmp && (unsigned)( tmp + sizeof(tmp) - p ) < min_digits )
+		*--p = '0';
+
+	const unsigned len = tmp + sizeof(tmp) - p;
+	memcpy( out, p, len );
+
+	return len;
+}
+
+// same as format_ull for a signed value (out: at least 21 bytes)
+inline unsigned format_ll ( char *out, const long long v )
+{
+	if ( v >= 0 )
+		return format_ull( out, v );
+
+	*out = '-';
+
+	return 1 + format_ull( out + 1, -(unsigned long long)v );
+}
+
+inline std::string ull_string ( const unsigned long long v, const unsigned min_digits = 1 )
+{
+	char buf[ 24 ];
+
+	return std::string( buf, format_ull( buf, v, min_digits ) );
+}
+
+// if the 8 bytes at s are decimal digits, store their value in *v and return true
+inline bool parse_8digits ( const char *s, uint64_t *v )
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t w;
+	memcpy( &w, s, 8 );
+
+	// every byte is 0x30..0x39: high nibble 3, and adding 6 does not carry into the high nibble
+	if ( ( ( w & 0xf0f0f0f0f0f0f0f0ULL ) | ( ( ( w + 0x0606060606060606ULL ) & 0xf0f0f0f0f0f0f0f0ULL ) >> 4 ) ) != 0x3333333333333333ULL )
+		return false;
+
+	// combine the digits by pairs, then by 4, then by 8 (the first digit is in the low byte)
+	w = ( ( w & 0x0f0f0f0f0f0f0f0fULL ) * 2561 ) >> 8;
+	w = ( ( w & 0x00ff00ff00ff00ffULL ) * 6553601 ) >> 16;
+	*v = ( ( w & 0x0000ffff0000ffffULL ) * 42949672960001ULL ) >> 32;
+
+	return true;
+#else
+	(void)s;
+	(void)v;
+
+	return false;
+#endif
+}
+
+// parse the leading decimal digits of s, at most max_digits (<= 19, so that the value fits)
+// return the number of digits parsed
+inline size_t parse_digits ( const char *s, const size_t len, const size_t max_digits, uint64_t *ret )
+{
+	const size_t end = ( len < max_digits ? len : max_digits );
+	uint64_t v = 0;
+	size_t i = 0;
+
+	for ( uint64_t v8 ; i + 8 <= end && parse_8digits( s + i, &v8 ) ; i += 8 )
+		v = v * 100000000 + v8;
+
+	for ( ; i < end && (unsigned)( s[ i ] - '0' ) < 10 ; ++i )
+		v = v * 10 + ( s[ i ] - '0' );
+
+	*ret = v;
+
+	return i;
+}
+
+// strtoll( s, NULL, 0 ), for an input that may not be nul-terminated
+inline long long parse_ll ( const char *s, const size_t len )
+{
+	size_t i = 0;
+	bool neg = false;
+
+	if ( len > 0 && ( s[ 0 ] == '-' || s[ 0 ] == '+' ) )
+	{
+		neg = ( s[ 0 ] == '-' );
+		++i;
+	}
+
+	if ( i < len && s[ i ] == '0' && ( i + 1 == len || ( (unsigned)( s[ i + 1 ] - '0' ) >= 10 && ( s[ i + 1 ] | 0x20 ) != 'x' ) ) )
+		return 0;
+
+	// plain decimal number of up to 18 digits: cannot overflow
+	if ( i < len && s[ i ] >= '1' && s[ i ] <= '9' )
+	{
+		uint64_t v;
+		const size_t n = parse_digits( s + i, len - i, 18, &v );
+
+		if ( i + n == len || (unsigned)( s[ i + n ] - '0' ) >= 10 )
+			return ( neg ? -(long long)v : (long long)v );
+	}
+
+	// octal, hex, spaces, overflow...
+	char buf[ 64 ];
+	if ( len < sizeof(buf) )
+	{
+		memcpy( buf, s, len );
+		buf[ len ] = 0;
+
+		return strtoll( buf, NULL, 0 );
+	}
+
+	return strtoll( std::string( s, len ).c_str(), NULL, 0 );
+}
+
+// parse an unsigned decimal string, all characters must be digits (an empty string is 0)
+// return false for invalid characters or a value that does not fit in 64 bits
+inline bool parse_ull ( const char *s, const size_t len, unsigned long long *ret )
+{
+	// skip the leading zeros, at most 20 significant digits
+	size_t i = 0;
+	while ( i < len && s[ i ] == '0' )
+		++i;
+
+	if ( len - i > 20 )
+		return false;
+
+	uint64_t v;
+	const size_t n = parse_digits( s + i, len - i, 19, &v );
+	i += n;
+
+	if ( i < len )
+	{
+		// 20th digit
+		const unsigned d = s[ i ] - '0';
+		if ( i + 1 < len || d >= 10 || v > ( ~(uint64_t)0 - d ) / 10 )
+			return false;
+
+		v = v * 10 + d;
+	}
+
+	*ret = v;
+
+	return true;
+}
+
+// parse an hex string (without 0x), all characters must be hex digits (an empty string is 0)
+// return false for invalid characters or a value that does not fit in 64 bits
+inline bool parse_hex ( const char *s, const size_t len, unsigned long long *ret )
+{
+	size_t i = 0;
+	while ( i < len && s[ i ] == '0' )
+		++i;
+
+	if ( len - i > 16 )
+		return false;
+
+	uint64_t v = 0;
+	int bad = 0;
+	for ( ; i < len ; ++i )
+	{
+		const int d = num_conv_hex[ (unsigned char)s[ i ] ];
+		bad |= d;
+		v = ( v << 4 ) | ( d & 0xf );
+	}
+
+	if ( bad < 0 )
+		return false;
+
+	*ret = v;
+
+	return true;
+}
+
+#endif
@@ -1,37 +1,658 @@
+#include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
-#include <fstream>
+#include <iostream>
+#include <vector>
+#include <new>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+#ifndef NO_ZSTD
+#include <zstd.h>
+#endif
 
 #include "output_buffer.h"
+#include "cpu_features.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// buffer alignment and O_DIRECT write granularity
+static const unsigned page_align = 4096;
+
+// maximum size of the independently compressed blocks
+static const unsigned compress_block = 1024*1024;
+
+class output_buffer::compressor
+{
+public:
+	int format;
+	bool failed;
+	std::vector< char > out;
+	size_t out_len;
+#ifndef NO_ZLIB
+	z_stream zs;
+#endif
+#ifndef NO_ZSTD
+	ZSTD_CCtx *zc;
+#endif
+
+	// max_len is the maximum length of a block
+	explicit compressor ( const int format, const unsigned max_len );
+	~compressor ( );
+
+	// compress len bytes as a complete gzip member / zstd frame in out, return false on error
+	bool compress ( const char *src, const unsigned len );
+
+private:
+	compressor ( const compressor& );
+	compressor& operator=( const compressor& );
+};
+
+output_buffer::compressor::compressor ( const int format, const unsigned max_len ) :
+	format(format),
+	failed(false),
+	out_len(0)
+{
+#ifndef NO_ZLIB
+	memset( &zs, 0, sizeof(zs) );
+	if ( format == COMPRESS_GZIP )
+	{
+		// 16: write a gzip header and trailer
+		if ( deflateInit2( &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 | 15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		{
+			std::cerr << "deflateInit: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+			failed = true;
+			return;
+		}
+		out.resize( deflateBound( &zs, max_len ) );
+	}
+#endif
+#ifndef NO_ZSTD
+	zc = NULL;
+	if ( format == COMPRESS_ZSTD )
+	{
+		zc = ZSTD_createCCtx();
+		if ( !zc )
+		{
+			std::cerr << "zstd: cannot create context" << std::endl;
+			failed = true;
+			return;
+		}
+		out.resize( ZSTD_compressBound( max_len ) );
+	}
+#endif
+}
+
+output_buffer::compressor::~compressor ( )
+{
+#ifndef NO_ZLIB
+	if ( format == COMPRESS_GZIP && !failed )
+		deflateEnd( &zs );
+#endif
+#ifndef NO_ZSTD
+	if ( zc )
+		ZSTD_freeCCtx( zc );
+#endif
+}
+
+bool output_buffer::compressor::compress ( const char *src, const unsigned len )
+{
+	if ( failed )
+		return false;
+
+#ifndef NO_ZLIB
+	if ( format == COMPRESS_GZIP )
+	{
+		deflateReset( &zs );
+		zs.next_in = (Bytef *)src;
+		zs.avail_in = len;
+		zs.next_out = (Bytef *)&out[ 0 ];
+		zs.avail_out = out.size();
+
+		// out is large enough for the whole member
+		if ( deflate( &zs, Z_FINISH ) != Z_STREAM_END )
+		{
+			std::cerr << "deflate: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+			return false;
+		}
+
+		out_len = out.size() - zs.avail_out;
+
+		return true;
+	}
+#endif
+#ifndef NO_ZSTD
+	if ( format == COMPRESS_ZSTD )
+	{
+		// level 3: zstd default
+		size_t ret = ZSTD_compressCCtx( zc, &out[ 0 ], out.size(), src, len, 3 );
+		if ( ZSTD_isError( ret ) )
+		{
+			std::cerr << "zstd: " << ZSTD_getErrorName( ret ) << std::endl;
+			return false;
+		}
+
+		out_len = ret;
+
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+int output_buffer::compression_by_name ( const char *name )
+{
+	if ( !strcmp( name, "none" ) )
+		return COMPRESS_NONE;
+#ifndef NO_ZLIB
+	if ( !strcmp( name, "gzip" ) || !strcmp( name, "gz" ) )
+		return COMPRESS_GZIP;
+#endif
+#ifndef NO_ZSTD
+	if ( !strcmp( name, "zstd" ) || !strcmp( name, "zst" ) )
+		return COMPRESS_ZSTD;
+#endif
+
+	return -1;
+}
+
+int output_buffer::compression_for_file ( const char *filename )
+{
+	if ( !filename )
+		return COMPRESS_NONE;
+
+	const char *ext = strrchr( filename, '.' );
+	if ( ext && ( !strcmp( ext, ".gz" ) || !strcmp( ext, ".zst" ) ) )
+		return compression_by_name( ext + 1 );
+
+	return COMPRESS_NONE;
+}
+
+// return the offset of the first byte of s[0..n) that is sep, quot, \r or \n, among the bytes checked by whole vectors
+// return the length checked (a multiple of the vector size) if none
+#ifdef CPU_DISPATCH
+TARGET_AVX512
+static size_t find_special_avx512 ( const char *s, const size_t n, const char sep, const char quot )
+{
+	const __m512i vsep = _mm512_set1_epi8( sep );
+	const __m512i vquot = _mm512_set1_epi8( quot );
+	const __m512i vcr = _mm512_set1_epi8( '\r' );
+	const __m512i vlf = _mm512_set1_epi8( '\n' );
+	size_t i = 0;
+
+	for ( ; i + 64 <= n ; i += 64 )
+	{
+		const __m512i v = _mm512_loadu_si512( (const void *)( s + i ) );
+		const uint64_t m = _mm512_cmpeq_epi8_mask( v, vsep ) | _mm512_cmpeq_epi8_mask( v, vquot ) |
+				_mm512_cmpeq_epi8_mask( v, vcr ) | _mm512_cmpeq_epi8_mask( v, vlf );
+		if ( m )
+			return i + __builtin_ctzll( m );
+	}
+
+	return i;
+}
+
+TARGET_AVX2
+static size_t find_special_avx2 ( const char *s, const size_t n, const char sep, const char quot )
+{
+	const __m256i vsep = _mm256_set1_epi8( sep );
+	const __m256i vquot = _mm256_set1_epi8( quot );
+	const __m256i vcr = _mm256_set1_epi8( '\r' );
+	const __m256i vlf = _mm256_set1_epi8( '\n' );
+	size_t i = 0;
+
+	for ( ; i + 32 <= n ; i += 32 )
+	{
+		const __m256i v = _mm256_loadu_si256( (const __m256i *)( s + i ) );
+		const __m256i eq = _mm256_or_si256( _mm256_or_si256( _mm256_cmpeq_epi8( v, vsep ), _mm256_cmpeq_epi8( v, vquot ) ),
+				_mm256_or_si256( _mm256_cmpeq_epi8( v, vcr ), _mm256_cmpeq_epi8( v, vlf ) ) );
+		const unsigned m = _mm256_movemask_epi8( eq );
+		if ( m )
+			return i + __builtin_ctz( m );
+	}
+
+	return i;
+}
+
+TARGET_SSE2
+static size_t find_special_sse2 ( const char *s, const size_t n, const char sep, const char quot )
+{
+	const __m128i vsep = _mm_set1_epi8( sep );
+	const __m128i vquot = _mm_set1_epi8( quot );
+	const __m128i vcr = _mm_set1_epi8( '\r' );
+	const __m128i vlf = _mm_set1_epi8( '\n' );
+	size_t i = 0;
+
+	for ( ; i + 16 <= n ; i += 16 )
+	{
+		const __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+		const __m128i eq = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, vsep ), _mm_cmpeq_epi8( v, vquot ) ),
+				_mm_or_si128( _mm_cmpeq_epi8( v, vcr ), _mm_cmpeq_epi8( v, vlf ) ) );
+		const unsigned m = _mm_movemask_epi8( eq );
+		if ( m )
+			return i + __builtin_ctz( m );
+	}
+
+	return i;
+}
+#endif
+
+bool output_buffer::csv_needs_quotes ( const char *s, const unsigned len, const char sep, const char quot )
+{
+	size_t i = 0;
+
+#ifdef CPU_DISPATCH
+	switch ( cpu_best_level() )
+	{
+	case CPU_AVX512:
+		i = find_special_avx512( s, len, sep, quot );
+		break;
+	case CPU_AVX2:
+		i = find_special_avx2( s, len, sep, quot );
+		break;
+	case CPU_SSE2:
+		i = find_special_sse2( s, len, sep, quot );
+		break;
+	default:
+		break;
+	}
+#endif
+
+	for ( ; i < len ; ++i )
+		if ( s[ i ] == sep || s[ i ] == quot || s[ i ] == '\r' || s[ i ] == '\n' )
+			return true;
+
+	return false;
+}
 
 bool output_buffer::failed_to_open ( ) const
 {
 	return badfile;
 }
 
-void output_buffer::flush ( )
+void output_buffer::alloc_buffers ( const unsigned count )
 {
-	if ( buf_end > 0 )
+	buf_size = ( buf_size + page_align - 1 ) & ~( page_align - 1 );
+
+	while ( bufs.size() < count )
 	{
-		output->write( buf, buf_end );
-		buf_end = 0;
+		void *ptr = NULL;
+		if ( posix_memalign( &ptr, page_align, buf_size ) )
+			throw std::bad_alloc();
+
+		bufs.push_back( (char *)ptr );
+	}
+
+	q_len.resize( bufs.size() );
+	buf = bufs[ q_head % bufs.size() ];
+}
+
+// start count compression threads, or compress from the caller thread if none can be started
+void output_buffer::start_workers ( unsigned count )
+{
+	pthread_mutex_init( &q_lock, NULL );
+	pthread_cond_init( &q_cond, NULL );
+
+	for ( unsigned i = 0 ; i < count ; ++i )
+	{
+		pthread_t t;
+		if ( pthread_create( &t, NULL, worker_thread, this ) )
+			break;
+
+		workers.push_back( t );
+	}
+
+	if ( workers.empty() )
+	{
+		pthread_cond_destroy( &q_cond );
+		pthread_mutex_destroy( &q_lock );
+
+		local_comp = new compressor( compress, buf_size );
+
+		return;
+	}
+
+	writer_running = true;
+}
+
+void output_buffer::start_writer ( )
+{
+	pthread_mutex_init( &q_lock, NULL );
+	pthread_cond_init( &q_cond, NULL );
+
+	if ( pthread_create( &writer, NULL, writer_thread, this ) )
+	{
+		pthread_cond_destroy( &q_cond );
+		pthread_mutex_destroy( &q_lock );
+
+		return;
+	}
+
+	writer_running = true;
+}
+
+// write all the queued buffers and stop the writer thread
+void output_buffer::stop_writer ( )
+{
+	pthread_mutex_lock( &q_lock );
+	q_stop = true;
+	pthread_cond_broadcast( &q_cond );
+	pthread_mutex_unlock( &q_lock );
+
+	if ( workers.empty() )
+		pthread_join( writer, NULL );
+	for ( unsigned i = 0 ; i < workers.size() ; ++i )
+		pthread_join( workers[ i ], NULL );
+	workers.clear();
+	writer_running = false;
+
+	pthread_cond_destroy( &q_cond );
+	pthread_mutex_destroy( &q_lock );
+}
+
+void *output_buffer::writer_thread ( void *ptr )
+{
+	((output_buffer *)ptr)->writer_loop();
+
+	return NULL;
+}
+
+// wake the other thread if it sleeps
+// the sleeping flag is set under q_lock before checking the queue state, and the queue indexes are updated before
+// reading the flag (all seq_cst): either the sleeper sees the new index, or the waker sees the flag
+void output_buffer::wake ( bool *sleeping )
+{
+	if ( ! __atomic_load_n( sleeping, __ATOMIC_SEQ_CST ) )
+		return;
+
+	pthread_mutex_lock( &q_lock );
+	pthread_cond_broadcast( &q_cond );
+	pthread_mutex_unlock( &q_lock );
+}
+
+void output_buffer::writer_loop ( )
+{
+	unsigned tail = q_tail;
+
+	while ( 1 )
+	{
+		if ( tail == __atomic_load_n( &q_head, __ATOMIC_SEQ_CST ) )
+		{
+			// queue empty: wait for queue_buffer() or stop_writer()
+			pthread_mutex_lock( &q_lock );
+			__atomic_store_n( &writer_sleeping, true, __ATOMIC_SEQ_CST );
+			while ( tail == __atomic_load_n( &q_head, __ATOMIC_SEQ_CST ) && ! q_stop )
+				pthread_cond_wait( &q_cond, &q_lock );
+			__atomic_store_n( &writer_sleeping, false, __ATOMIC_SEQ_CST );
+			const bool done = ( tail == __atomic_load_n( &q_head, __ATOMIC_SEQ_CST ) );
+			pthread_mutex_unlock( &q_lock );
+
+			if ( done )
+				return;
+
+			continue;
+		}
+
+		const unsigned idx = tail % bufs.size();
+		write_block( bufs[ idx ], q_len[ idx ] );
+
+		__atomic_store_n( &q_tail, ++tail, __ATOMIC_SEQ_CST );
+		wake( &caller_sleeping );
+	}
+}
+
+void *output_buffer::worker_thread ( void *ptr )
+{
+	((output_buffer *)ptr)->worker_loop();
+
+	return NULL;
+}
+
+// compress the queue entries in turn, and write each one once the previous entries are written
+void output_buffer::worker_loop ( )
+{
+	compressor comp( compress, buf_size );
+
+	pthread_mutex_lock( &q_lock );
+
+	while ( 1 )
+	{
+		while ( q_claim == __atomic_load_n( &q_head, __ATOMIC_SEQ_CST ) && ! q_stop )
+			pthread_cond_wait( &q_cond, &q_lock );
+
+		if ( q_claim == __atomic_load_n( &q_head, __ATOMIC_SEQ_CST ) )
+			break;
+
+		const unsigned seq = q_claim++;
+		pthread_mutex_unlock( &q_lock );
+
+		const unsigned idx = seq % bufs.size();
+		const bool ok = comp.compress( bufs[ idx ], q_len[ idx ] );
+
+		pthread_mutex_lock( &q_lock );
+		while ( __atomic_load_n( &q_tail, __ATOMIC_SEQ_CST ) != seq )
+			pthread_cond_wait( &q_cond, &q_lock );
+		pthread_mutex_unlock( &q_lock );
+
+		// only this thread writes until q_tail moves
+		if ( ok )
+			write_out( &comp.out[ 0 ], comp.out_len );
+		else
+			__atomic_store_n( &write_failed, true, __ATOMIC_SEQ_CST );
+
+		pthread_mutex_lock( &q_lock );
+		__atomic_store_n( &q_tail, seq + 1, __ATOMIC_SEQ_CST );
+		pthread_cond_broadcast( &q_cond );
+	}
+
+	pthread_mutex_unlock( &q_lock );
+}
+
+void output_buffer::queue_buffer ( const unsigned len )
+{
+	const unsigned head = q_head;
+	q_len[ head % bufs.size() ] = len;
+	__atomic_store_n( &q_head, head + 1, __ATOMIC_SEQ_CST );
+	if ( workers.empty() )
+		wake( &writer_sleeping );
+	else
+	{
+		// the compression workers check q_head under q_lock
+		pthread_mutex_lock( &q_lock );
+		pthread_cond_broadcast( &q_cond );
+		pthread_mutex_unlock( &q_lock );
+	}
+
+	// wait until the next buffer is written
+	wait_queued( bufs.size() - 1 );
+
+	char *next = bufs[ ( head + 1 ) % bufs.size() ];
+	memcpy( next, buf + len, buf_end - len );
+	buf = next;
+	buf_end -= len;
+}
+
+void output_buffer::wait_queued ( const unsigned count )
+{
+	if ( q_head - __atomic_load_n( &q_tail, __ATOMIC_SEQ_CST ) <= count )
+		return;
+
+	pthread_mutex_lock( &q_lock );
+	__atomic_store_n( &caller_sleeping, true, __ATOMIC_SEQ_CST );
+	while ( q_head - __atomic_load_n( &q_tail, __ATOMIC_SEQ_CST ) > count )
+		pthread_cond_wait( &q_cond, &q_lock );
+	__atomic_store_n( &caller_sleeping, false, __ATOMIC_SEQ_CST );
+	pthread_mutex_unlock( &q_lock );
+}
+
+// write all the iov data, retry after partial writes
+// iov is modified
+void output_buffer::write_iov ( struct iovec *iov, unsigned count )
+{
+	while ( count > 0 && ! __atomic_load_n( &write_failed, __ATOMIC_SEQ_CST ) )
+	{
+		ssize_t ret = writev( fd, iov, ( count > IOV_MAX ? IOV_MAX : count ) );
+
+		if ( ret < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			if ( errno == EINVAL && direct )
+			{
+				// O_DIRECT not supported for this file after all
+				disable_direct();
+				continue;
+			}
+
+			std::cerr << "Write error: " << strerror( errno ) << std::endl;
+			__atomic_store_n( &write_failed, true, __ATOMIC_SEQ_CST );
+
+			return;
+		}
+
+		// skip what was written
+		size_t done = ret;
+		while ( count > 0 && done >= iov->iov_len )
+		{
+			done -= iov->iov_len;
+			++iov;
+			--count;
+		}
+
+		if ( count > 0 )
+		{
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+}
+
+void output_buffer::write_out ( const char *s, const unsigned len )
+{
+	if ( output_str )
+	{
+		output_str->append( s, len );
+
+		return;
 	}
 
-	output->flush();
+	struct iovec iov;
+	iov.iov_base = (void *)s;
+	iov.iov_len = len;
+
+	write_iov( &iov, 1 );
+}
+
+void output_buffer::write_block ( const char *s, const unsigned len )
+{
+	// only the end of the output may be unaligned
+	if ( direct && len % page_align )
+		disable_direct();
+
+	write_out( s, len );
+}
+
+void output_buffer::write_compressed ( compressor *comp, const char *s, const unsigned len )
+{
+	if ( comp->compress( s, len ) )
+		write_out( &comp->out[ 0 ], comp->out_len );
+	else
+		__atomic_store_n( &write_failed, true, __ATOMIC_SEQ_CST );
+}
+
+void output_buffer::disable_direct ( )
+{
+	int flags = fcntl( fd, F_GETFL );
+	if ( flags != -1 )
+		fcntl( fd, F_SETFL, flags & ~O_DIRECT );
+
+	direct = false;
+}
+
+void output_buffer::flush_buffer ( const bool final )
+{
+	unsigned len = buf_end;
+
+	// direct mode: keep the partial page for later
+	if ( whole_pages && ! final )
+		len &= ~( page_align - 1 );
+
+	// a compressed output holds at least one (empty) gzip member / zstd frame
+	if ( len == 0 && ! ( final && compress != COMPRESS_NONE && ! flushed_any ) )
+		return;
+
+	flushed_any = true;
+
+	if ( writer_running )
+	{
+		queue_buffer( len );
+
+		return;
+	}
+
+	if ( local_comp )
+		write_compressed( local_comp, buf, len );
+	else
+		write_block( buf, len );
+
+	if ( len < buf_end )
+		memmove( buf, buf + len, buf_end - len );
+	buf_end -= len;
+}
+
+void output_buffer::flush ( )
+{
+	flush_buffer( false );
 }
 
 void output_buffer::append ( const char *s, const unsigned len )
 {
+	if ( len < buf_size - buf_end )
+	{
+		memcpy( buf + buf_end, s, len );
+		buf_end += len;
+
+		return;
+	}
+
+	if ( ! output_str && ! whole_pages && ! writer_running && compress == COMPRESS_NONE )
+	{
+		// write the buffer and s at once
+		struct iovec iov[ 2 ];
+		iov[ 0 ].iov_base = buf;
+		iov[ 0 ].iov_len = buf_end;
+		iov[ 1 ].iov_base = (void *)s;
+		iov[ 1 ].iov_len = len;
+
+		write_iov( iov, 2 );
+		buf_end = 0;
+
+		return;
+	}
+
+	// fill the buffer, so that direct writes are whole buffers
 	unsigned len_left = len;
 
 	while ( len_left >= buf_size - buf_end )
 	{
-		if ( buf_end < buf_size )
-			memcpy( buf + buf_end, s, buf_size - buf_end );
-		output->write( buf, buf_size );
-		len_left -= buf_size - buf_end;
-		s += buf_size - buf_end;
-		buf_end = 0;
+		const unsigned chunk = buf_size - buf_end;
+
+		memcpy( buf + buf_end, s, chunk );
+		buf_end = buf_size;
+		flush_buffer( false );
+		len_left -= chunk;
+		s += chunk;
 	}
 
 	if ( len_left > 0 )
@@ -53,10 +674,160 @@ void output_buffer::append ( const std::string &str )
 
 void output_buffer::append ( const char c )
 {
-	if ( buf_end < buf_size - 1 )
-		buf[ buf_end++ ] = c;
-	else
-		append( &c, 1 );
+	if ( buf_end == buf_size )
+		flush_buffer( false );
+
+	buf[ buf_end++ ] = c;
+}
+
+void output_buffer::append ( const struct iovec *iov, const unsigned count )
+{
+	size_t total = 0;
+	for ( unsigned i = 0 ; i < count ; ++i )
+		total += iov[ i ].iov_len;
+
+	if ( total < buf_size - buf_end )
+	{
+		for ( unsigned i = 0 ; i < count ; ++i )
+		{
+			memcpy( buf + buf_end, iov[ i ].iov_base, iov[ i ].iov_len );
+			buf_end += iov[ i ].iov_len;
+		}
+
+		return;
+	}
+
+	if ( output_str || whole_pages || writer_running || compress != COMPRESS_NONE )
+	{
+		for ( unsigned i = 0 ; i < count ; ++i )
+			append( (const char *)iov[ i ].iov_base, iov[ i ].iov_len );
+
+		return;
+	}
+
+	// write the buffer and all the slices with one writev
+	std::vector< struct iovec > all( count + 1 );
+	all[ 0 ].iov_base = buf;
+	all[ 0 ].iov_len = buf_end;
+	for ( unsigned i = 0 ; i < count ; ++i )
+		all[ i + 1 ] = iov[ i ];
+
+	write_iov( &all[ 0 ], all.size() );
+	buf_end = 0;
+}
+
+// copy from in_fd with copy_file_range(2) (file to file, may share the blocks on some filesystems), or with sendfile(2)
+// return the number of bytes copied, less than len if the kernel cannot copy between these files
+uint64_t output_buffer::copy_fd ( const int in_fd, const uint64_t off, const uint64_t len )
+{
+	uint64_t done = 0;
+
+#ifdef __linux__
+	bool copy_range = true;
+
+	while ( done < len && ! __atomic_load_n( &write_failed, __ATOMIC_SEQ_CST ) )
+	{
+		const size_t chunk = ( len - done > 1024*1024*1024 ? 1024*1024*1024 : len - done );
+		ssize_t ret;
+
+		if ( copy_range )
+		{
+			loff_t in_off = off + done;
+			ret = copy_file_range( in_fd, &in_off, fd, NULL, chunk, 0 );
+			if ( ret < 0 && errno != EINTR && errno != ENOSPC && errno != EIO && errno != EFBIG )
+			{
+				// not supported for these files (output is not a regular file, other filesystem, old kernel...)
+				copy_range = false;
+				continue;
+			}
+		}
+		else
+		{
+			off_t in_off = off + done;
+			ret = sendfile( fd, in_fd, &in_off, chunk );
+			if ( ret < 0 && ( errno == EINVAL || errno == ENOSYS ) )
+				break;
+		}
+
+		if ( ret < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			std::cerr << "Write error: " << strerror( errno ) << std::endl;
+			__atomic_store_n( &write_failed, true, __ATOMIC_SEQ_CST );
+
+			break;
+		}
+
+		// input file truncated
+		if ( ret == 0 )
+			break;
+
+		done += ret;
+	}
+#endif
+
+	return done;
+}
+
+void output_buffer::append_file ( const int in_fd, const uint64_t off, const char *data, const uint64_t len )
+{
+	uint64_t done = 0;
+
+	if ( ! output_str && compress == COMPRESS_NONE && len >= page_align )
+	{
+		// the buffered data goes first
+		flush_buffer( true );
+		if ( writer_running )
+			wait_queued( 0 );
+
+		if ( direct )
+			disable_direct();
+		whole_pages = false;
+
+		done = copy_fd( in_fd, off, len );
+		if ( __atomic_load_n( &write_failed, __ATOMIC_SEQ_CST ) )
+			return;
+	}
+
+	while ( done < len )
+	{
+		const unsigned chunk = ( len - done > buf_size ? buf_size : len - done );
+
+		append( data + done, chunk );
+		done += chunk;
+	}
+}
+
+void output_buffer::append_csv_field ( const char *s, const unsigned len, const char sep, const char quot )
+{
+	if ( ! csv_needs_quotes( s, len, sep, quot ) )
+	{
+		append( s, len );
+
+		return;
+	}
+
+	append( quot );
+
+	// double the quotes
+	const char *end = s + len;
+	const char *q;
+	while ( ( q = (const char *)memchr( s, quot, end - s ) ) )
+	{
+		append( s, q + 1 - s );
+		append( quot );
+		s = q + 1;
+	}
+
+	append( s, end - s );
+	append( quot );
+}
+
+void output_buffer::append_csv_field ( const std::string &str, const char sep, const char quot )
+{
+	append_csv_field( str.data(), str.size(), sep, quot );
 }
 
 void output_buffer::append_nl ( )
@@ -65,37 +836,116 @@ void output_buffer::append_nl ( )
 	append( '\n' );
 }
 
-output_buffer::output_buffer ( const char *filename, const unsigned buf_size ) :
+output_buffer::output_buffer ( const char *filename, const unsigned buf_size, const bool direct, const unsigned async_buffers,
+		const int compress, const unsigned compress_threads ) :
+	fd(1),
+	should_close_fd(false),
 	badfile(false),
+	direct(false),
+	whole_pages(false),
+	write_failed(false),
+	output_str(NULL),
 	buf_end(0),
-	buf_size(buf_size)
+	buf_size(buf_size),
+	buf(NULL),
+	q_head(0),
+	q_tail(0),
+	writer_running(false),
+	writer_sleeping(false),
+	caller_sleeping(false),
+	q_stop(false),
+	compress(compress),
+	q_claim(0),
+	local_comp(NULL),
+	flushed_any(false)
 {
-	buf = new char[buf_size];
+	unsigned threads = 0;
+	unsigned nbufs = ( async_buffers >= 2 ? async_buffers : 1 );
+
+	if ( compress != COMPRESS_NONE )
+	{
+		if ( this->buf_size > compress_block )
+			this->buf_size = compress_block;
+
+		threads = compress_threads;
+		if ( threads == 0 )
+		{
+			long ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+			threads = ( ncpu > 0 ? ncpu : 1 );
+		}
+
+		// one buffer per thread, one being filled, one waiting
+		if ( nbufs < threads + 2 )
+			nbufs = threads + 2;
+	}
+
+	alloc_buffers( nbufs );
+
+	const bool use_direct = ( direct && compress == COMPRESS_NONE );
 
 	if ( filename )
 	{
-		should_delete_output = true;
-		output = new std::ofstream(filename);
-		if ( ! *output )
+		fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC | ( use_direct ? O_DIRECT : 0 ), 0666 );
+		if ( fd == -1 && use_direct && errno == EINVAL )
+			// filesystem without O_DIRECT support (eg tmpfs)
+			fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+		else
+			this->direct = whole_pages = use_direct;
+
+		if ( fd == -1 )
 		{
 			std::cerr << "Cannot open " << filename << ": " << strerror( errno ) << std::endl;
 			badfile = true;
 			return;
 		}
+
+		should_close_fd = true;
 	}
-	else
-	{
-		should_delete_output = false;
-		output = &std::cout;
-	}
+
+	if ( compress != COMPRESS_NONE )
+		start_workers( threads );
+	else if ( bufs.size() >= 2 )
+		start_writer();
+}
+
+output_buffer::output_buffer ( std::string *str, const unsigned buf_size ) :
+	fd(-1),
+	should_close_fd(false),
+	badfile(false),
+	direct(false),
+	whole_pages(false),
+	write_failed(false),
+	output_str(str),
+	buf_end(0),
+	buf_size(buf_size),
+	buf(NULL),
+	q_head(0),
+	q_tail(0),
+	writer_running(false),
+	writer_sleeping(false),
+	caller_sleeping(false),
+	q_stop(false),
+	compress(COMPRESS_NONE),
+	q_claim(0),
+	local_comp(NULL),
+	flushed_any(false)
+{
+	alloc_buffers( 1 );
 }
 
 output_buffer::~output_buffer ( )
 {
-	flush();
+	if ( ! badfile )
+		flush_buffer( true );
+
+	if ( writer_running )
+		stop_writer();
+
+	delete local_comp;
 
-	if ( should_delete_output )
-		delete output;
+	if ( should_close_fd && close( fd ) && ! __atomic_load_n( &write_failed, __ATOMIC_SEQ_CST ) )
+		std::cerr << "Write error: " << strerror( errno ) << std::endl;
 
-	delete[] buf;
+	for ( unsigned i = 0 ; i < bufs.size() ; ++i )
+		free( bufs[ i ] );
 }
@@ -1,19 +1,112 @@
 #ifndef OUTPUT_BUFFER_H
 #define OUTPUT_BUFFER_H
 
-#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
+/*
+ * Buffered output to a file or stdout, or to a string
+ *
+ * Data is accumulated in a page-aligned buffer, written with write(2) when full. Data that does not fit in the buffer
+ * is written along with the buffered data with a single writev(2).
+ * In direct mode, the output file is opened with O_DIRECT, bypassing the page cache: only whole pages of the buffer
+ * are written, the unaligned end of the output is written without O_DIRECT when the output_buffer is destroyed.
+ *
+ * In asynchronous mode, the filled buffers are written by a background thread, and the caller goes on in the next buffer.
+ * The buffers are handed over through a single producer / single consumer ring ; the caller only waits when all the
+ * buffers are queued (slow output).
+ *
+ * Compressed output (gzip or zstd) splits the data in independent blocks of up to 1MB, compressed in parallel by a pool
+ * of threads. Each block becomes a complete gzip member or zstd frame, written in order by the thread that compressed it
+ * once the previous blocks are written: the result is a regular multi-member gzip or multi-frame zstd stream.
+ */
 class output_buffer
 {
+public:
+	enum {
+		COMPRESS_NONE,
+		COMPRESS_GZIP,
+		COMPRESS_ZSTD,
+	};
+
 private:
-	std::ostream *output;
-	bool should_delete_output;
+	// compression state of a thread (zlib / zstd stream and output block)
+	class compressor;
+
+
+	// output file descriptor, -1 for a string output
+	int fd;
+	bool should_close_fd;
 	bool badfile;
+	// O_DIRECT is set on fd (changed by the writer thread in asynchronous mode)
+	bool direct;
+	// the file was opened with O_DIRECT: only write whole pages until the end
+	bool whole_pages;
+	// a write failed, further output is discarded (set by the writer and compression threads, use __atomic builtins)
+	bool write_failed;
+
+	// in-memory output, used instead of fd when not NULL
+	std::string *output_str;
 
 	unsigned buf_end;
 	unsigned buf_size;
 	char *buf;
 
+	// all the buffers (one in synchronous mode)
+	// in asynchronous mode, queue entry i uses bufs[ i % bufs.size() ], the entries in [q_tail, q_head) are waiting to be written
+	std::vector< char * > bufs;
+	std::vector< unsigned > q_len;
+	unsigned q_head;	// updated by the caller thread
+	unsigned q_tail;	// updated by the writer thread (compression workers: by the worker that wrote the entry)
+	// the writer thread or the compression workers are running
+	bool writer_running;
+	pthread_t writer;
+	// only used to sleep when the queue is empty (writer) or full (caller)
+	pthread_mutex_t q_lock;
+	pthread_cond_t q_cond;
+	bool writer_sleeping;
+	bool caller_sleeping;
+	bool q_stop;
+
+	// compression format, and threads compressing the queued buffers (instead of the writer thread)
+	int compress;
+	std::vector< pthread_t > workers;
+	// next queue entry to be compressed, protected by q_lock
+	unsigned q_claim;
+	// used to compress in the caller thread if no worker could be started
+	compressor *local_comp;
+	// something was flushed (a compressed output is never empty)
+	bool flushed_any;
+
+	void alloc_buffers ( const unsigned count );
+	void start_writer ( );
+	void start_workers ( unsigned count );
+	void stop_writer ( );
+	static void *writer_thread ( void *ptr );
+	void writer_loop ( );
+	static void *worker_thread ( void *ptr );
+	void worker_loop ( );
+	void wake ( bool *sleeping );
+	// hand the first len bytes of buf to the writer thread, go on with the rest in the next buffer
+	void queue_buffer ( const unsigned len );
+	// wait until at most count buffers are queued
+	void wait_queued ( const unsigned count );
+
+	void write_out ( const char *s, const unsigned len );
+	// write_out, clearing O_DIRECT first for an unaligned length
+	void write_block ( const char *s, const unsigned len );
+	void write_iov ( struct iovec *iov, unsigned count );
+	void disable_direct ( );
+	uint64_t copy_fd ( const int in_fd, const uint64_t off, const uint64_t len );
+	// compress and write a block
+	void write_compressed ( compressor *comp, const char *s, const unsigned len );
+
+	// write the buffer content, only whole pages in direct mode unless final
+	void flush_buffer ( const bool final );
+
 public:
 	bool failed_to_open ( ) const;
 	void flush ( );
@@ -21,10 +114,32 @@ public:
 	void append ( const std::string *str );
 	void append ( const std::string &str );
 	void append ( const char c );
+	// append count slices at once
+	void append ( const struct iovec *iov, const unsigned count );
 	void append_nl ( );
-	explicit output_buffer ( const char *filename, const unsigned buf_size = 64*1024 );
+	// append an unescaped field as a csv field: quoted if it holds sep, quot or a newline, with the quotes doubled
+	void append_csv_field ( const char *s, const unsigned len, const char sep = ',', const char quot = '"' );
+	void append_csv_field ( const std::string &str, const char sep = ',', const char quot = '"' );
+	// append len bytes of the file in_fd from offset off, sent by the kernel without a copy through user space when possible
+	// data holds the same bytes, used when the output cannot be written directly from the file (string or compressed output)
+	void append_file ( const int in_fd, const uint64_t off, const char *data, const uint64_t len );
+	// write to filename (stdout if NULL), with O_DIRECT if direct is set and the filesystem supports it
+	// with async_buffers >= 2, write from a background thread with up to async_buffers buffers in use
+	// compress the output with compress_threads threads (0 = one per cpu) ; direct is ignored for compressed output
+	explicit output_buffer ( const char *filename, const unsigned buf_size = 4*1024*1024, const bool direct = false, const unsigned async_buffers = 0,
+			const int compress = COMPRESS_NONE, const unsigned compress_threads = 0 );
+	// append all output to a string
+	explicit output_buffer ( std::string *str, const unsigned buf_size = 64*1024 );
 	~output_buffer ( );
 
+	// return true if a field holding s needs to be quoted in a csv with this separator and quote
+	static bool csv_needs_quotes ( const char *s, const unsigned len, const char sep, const char quot );
+
+	// return the compression format for a name ("gzip", "zstd", "none"), -1 if unknown or not supported
+	static int compression_by_name ( const char *name );
+	// return the compression format matching the extension of a file name (.gz, .zst)
+	static int compression_for_file ( const char *filename );
+
 private:
 	output_buffer ( const output_buffer& );
 	output_buffer& operator=( const output_buffer& );
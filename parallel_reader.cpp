@@ -0,0 +1,328 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <algorithm>
+
+#include "parallel_reader.h"
+#include "csv_reader.h"
+#include "output_buffer.h"
+#include "row_index.h"
+
+// chunk size bounds ; the actual size depends on the input size and the thread count
+static const uint64_t chunk_size_min = 1024*1024;
+static const uint64_t chunk_size_max = 64*1024*1024;
+
+// how far to look for a quote telling the quote state at a chunk boundary
+static const uint64_t speculate_window = 1024*1024;
+
+parallel_reader::parallel_reader ( const char *filename, const char sep, const char quot, const unsigned line_max, const unsigned nthreads ) :
+	filename(filename),
+	sep(sep),
+	quot(quot),
+	line_max(line_max),
+	nthreads(nthreads > 0 ? nthreads : 1),
+	map(NULL),
+	map_size(0),
+	badfile(false),
+	handler(NULL),
+	handler_ctx(NULL),
+	data_start(0),
+	chunk_count(0),
+	bounds_exact(false),
+	chunk_next(0),
+	chunk_written(0)
+{
+	pthread_mutex_init( &lock, NULL );
+	pthread_cond_init( &cond_done, NULL );
+	pthread_cond_init( &cond_free, NULL );
+
+	int fd = open( filename, O_RDONLY );
+	struct stat st;
+	if ( fd == -1 || fstat( fd, &st ) || !S_ISREG( st.st_mode ) )
+	{
+		std::cerr << "Cannot open " << filename << ": " << strerror( errno ) << std::endl;
+		if ( fd != -1 )
+			close( fd );
+		badfile = true;
+		return;
+	}
+
+	map_size = st.st_size;
+	if ( map_size > 0 )
+	{
+		void *ptr = mmap( NULL, map_size, PROT_READ, MAP_SHARED, fd, 0 );
+		if ( ptr == MAP_FAILED )
+		{
+			std::cerr << "Cannot mmap " << filename << ": " << strerror( errno ) << std::endl;
+			badfile = true;
+		}
+		else
+			map = (const char *)ptr;
+	}
+	close( fd );
+
+	row_index index;
+	if ( map && index.load( filename, sep, quot ) && ! index.is_compressed() )
+		index.row_offsets( &index_offsets );
+}
+
+parallel_reader::~parallel_reader ( )
+{
+	if ( map )
+		munmap( (void *)map, map_size );
+
+	pthread_cond_destroy( &cond_free );
+	pthread_cond_destroy( &cond_done );
+	pthread_mutex_destroy( &lock );
+}
+
+bool parallel_reader::failed_to_open ( ) const
+{
+	return badfile;
+}
+
+uint64_t parallel_reader::chunk_begin ( unsigned k ) const
+{
+	return bounds[ k ];
+}
+
+// rows starting at or after this offset belong to the next chunk ; 0 for the last chunk (no limit)
+uint64_t parallel_reader::chunk_limit ( unsigned k ) const
+{
+	if ( k + 1 >= chunk_count )
+		return 0;
+
+	return bounds[ k + 1 ];
+}
+
+// guess the offset of the first row starting at or after off
+//
+// the quote state at off is deduced from the first quote that can only be an opening quote (preceded by a separator or a newline
+// and followed by something else), or only a closing quote (the reverse), and the parity of the quotes before it.
+// without such a quote, assume we are not inside a quoted field. Then the row starts after the first newline outside quotes.
+uint64_t parallel_reader::guess_row_start ( uint64_t off ) const
+{
+	if ( off >= map_size )
+		return map_size;
+
+	bool in_quote = false;
+	unsigned quotes = 0;
+	const char *end = map + ( map_size - off > speculate_window ? off + speculate_window : map_size );
+	const char *q = map + off;
+
+	while ( ( q = (const char *)memchr( q, quot, end - q ) ) )
+	{
+		const char prev = ( q > map ? q[ -1 ] : '\n' );
+		const char next = ( q + 1 < map + map_size ? q[ 1 ] : '\n' );
+
+		if ( next == quot )
+		{
+			// escaped quote or empty field, same quote state afterwards
+			q += 2;
+			if ( q >= end )
+				break;
+			continue;
+		}
+
+		const bool prev_struct = ( prev == sep || prev == '\n' );
+		const bool next_struct = ( next == sep || next == '\n' || next == '\r' );
+
+		if ( prev_struct && !next_struct )
+		{
+			// opening quote
+			in_quote = ( quotes & 1 );
+			break;
+		}
+
+		if ( !prev_struct && next_struct )
+		{
+			// closing quote
+			in_quote = !( quotes & 1 );
+			break;
+		}
+
+		// quote in the middle of an unquoted field (ignored by the parser), or ambiguous
+		if ( prev_struct )
+			++quotes;
+
+		if ( ++q >= end )
+			break;
+	}
+
+	if ( !in_quote && off > 0 && map[ off - 1 ] == '\n' )
+		return off;
+
+	for ( const char *p = map + off ; p < map + map_size ; ++p )
+	{
+		if ( *p == quot )
+			in_quote = !in_quote;
+		else if ( *p == '\n' && !in_quote )
+			return p + 1 - map;
+	}
+
+	return map_size;
+}
+
+// run the handler on all rows of chunk k, starting at offset first
+void parallel_reader::parse_chunk ( csv_reader *reader, unsigned k, uint64_t first, chunk_slot *slot )
+{
+	slot->start = first;
+	slot->end = first;
+	slot->out.clear();
+
+	if ( ! reader->seek( first ) )
+		return;
+
+	reader->set_row_limit( chunk_limit( k ) );
+
+	if ( reader->fetch_line() )
+	{
+		output_buffer out( &slot->out );
+		handler( handler_ctx, reader, &out );
+	}
+
+	slot->end = reader->next_row_offset();
+}
+
+void parallel_reader::worker ( )
+{
+	csv_reader reader( filename.c_str(), sep, quot, line_max );
+
+	while ( 1 )
+	{
+		pthread_mutex_lock( &lock );
+		while ( chunk_next < chunk_count && chunk_next >= chunk_written + slots.size() )
+			pthread_cond_wait( &cond_free, &lock );
+
+		if ( chunk_next >= chunk_count )
+		{
+			pthread_mutex_unlock( &lock );
+			break;
+		}
+
+		unsigned k = chunk_next++;
+		chunk_slot *slot = &slots[ k % slots.size() ];
+		pthread_mutex_unlock( &lock );
+
+		uint64_t first = ( k == 0 || bounds_exact ? chunk_begin( k ) : guess_row_start( chunk_begin( k ) ) );
+		parse_chunk( &reader, k, first, slot );
+
+		pthread_mutex_lock( &lock );
+		slot->done = true;
+		pthread_cond_broadcast( &cond_done );
+		pthread_mutex_unlock( &lock );
+	}
+}
+
+void *parallel_reader::worker_thread ( void *arg )
+{
+	((parallel_reader *)arg)->worker();
+
+	return NULL;
+}
+
+// run handler on every row from offset start (a row start) to the end of the file, append the outputs to outbuf in file order
+void parallel_reader::run ( uint64_t start, chunk_handler handler, void *ctx, output_buffer *outbuf )
+{
+	if ( badfile || start >= map_size )
+		return;
+
+	this->handler = handler;
+	handler_ctx = ctx;
+	data_start = start;
+
+	uint64_t chunk_size = ( map_size - start ) / ( nthreads * 4 );
+	if ( chunk_size < chunk_size_min )
+		chunk_size = chunk_size_min;
+	if ( chunk_size > chunk_size_max )
+		chunk_size = chunk_size_max;
+
+	bounds.clear();
+	bounds.push_back( start );
+	bounds_exact = !index_offsets.empty();
+	for ( uint64_t off = start + chunk_size ; off < map_size ; off += chunk_size )
+	{
+		if ( ! bounds_exact )
+		{
+			bounds.push_back( off );
+			continue;
+		}
+
+		// first indexed row at or after the nominal boundary
+		std::vector< uint64_t >::const_iterator it = std::lower_bound( index_offsets.begin(), index_offsets.end(), off );
+		if ( it == index_offsets.end() )
+			break;
+		if ( *it > bounds.back() && *it < map_size )
+			bounds.push_back( *it );
+	}
+	chunk_count = bounds.size();
+
+	chunk_next = 0;
+	chunk_written = 0;
+	slots.clear();
+	slots.resize( nthreads * 2 );
+	for ( unsigned i = 0 ; i < slots.size() ; ++i )
+		slots[ i ].done = false;
+
+	std::vector< pthread_t > threads( nthreads );
+	for ( unsigned i = 0 ; i < nthreads ; ++i )
+		if ( pthread_create( &threads[ i ], NULL, worker_thread, this ) )
+		{
+			std::cerr << "Cannot create thread: " << strerror( errno ) << std::endl;
+			threads.resize( i );
+			break;
+		}
+
+	// used to parse again chunks with a bad row start guess
+	csv_reader *fix_reader = NULL;
+	uint64_t expected = start;
+
+	for ( unsigned k = 0 ; k < chunk_count ; ++k )
+	{
+		chunk_slot *slot = &slots[ k % slots.size() ];
+
+		if ( threads.empty() )
+		{
+			// no worker: do everything here
+			if ( ! fix_reader )
+				fix_reader = new csv_reader( filename.c_str(), sep, quot, line_max );
+			parse_chunk( fix_reader, k, expected, slot );
+		}
+		else
+		{
+			pthread_mutex_lock( &lock );
+			while ( ! slot->done )
+				pthread_cond_wait( &cond_done, &lock );
+			pthread_mutex_unlock( &lock );
+		}
+
+		if ( slot->start != expected )
+		{
+			// misspeculation
+			if ( ! fix_reader )
+				fix_reader = new csv_reader( filename.c_str(), sep, quot, line_max );
+			parse_chunk( fix_reader, k, expected, slot );
+		}
+
+		outbuf->append( slot->out );
+		expected = slot->end;
+
+		pthread_mutex_lock( &lock );
+		slot->done = false;
+		++chunk_written;
+		pthread_cond_broadcast( &cond_free );
+		pthread_mutex_unlock( &lock );
+	}
+
+	for ( unsigned i = 0 ; i < threads.size() ; ++i )
+		pthread_join( threads[ i ], NULL );
+
+	if ( fix_reader )
+		delete fix_reader;
+
+	slots.clear();
+}
@@ -0,0 +1,104 @@
+#ifndef PARALLEL_READER_H
+#define PARALLEL_READER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+class csv_reader;
+class output_buffer;
+
+/*
+ * Process a regular (mmapped) csv file with many threads
+ *
+ * The input is split in byte ranges (chunks). Each worker thread guesses where the first row of its chunk starts, by speculating
+ * on the quote state at the chunk boundary, and runs the chunk handler on all rows starting inside the chunk.
+ *
+ * The chunk outputs are written in file order by the calling thread. At this point the chunk guesses are checked: the first row of
+ * chunk n must start exactly where the last row of chunk n-1 ended. If not (eg the boundary fell inside a multi-line quoted field),
+ * chunk n is parsed again from the correct offset before being written.
+ *
+ * If the file has an up to date row index (see row_index), the chunk boundaries are moved to indexed row starts, and no
+ * guess is needed.
+ *
+ * The number of chunks in flight is bounded, so that memory usage does not depend on the input size.
+ */
+class parallel_reader
+{
+public:
+	// called for each chunk, from a worker thread, with the first row of the chunk already fetched
+	// reader->fetch_line() returns false after the last row of the chunk ; the handler must consume all rows
+	// all output should go to out
+	typedef void (*chunk_handler) ( void *ctx, csv_reader *reader, output_buffer *out );
+
+private:
+	struct chunk_slot {
+		// offset of the first row (guessed by the worker)
+		uint64_t start;
+		// offset of the first row following the chunk
+		uint64_t end;
+		std::string out;
+		bool done;
+	};
+
+	std::string filename;
+	char sep;
+	char quot;
+	unsigned line_max;
+	unsigned nthreads;
+
+	// read-only view of the whole file, used to guess row starts
+	const char *map;
+	uint64_t map_size;
+	bool badfile;
+
+	// row start offsets from the file row index, sorted ; empty if there is no index
+	std::vector< uint64_t > index_offsets;
+
+	// current run() parameters
+	chunk_handler handler;
+	void *handler_ctx;
+	uint64_t data_start;
+	unsigned chunk_count;
+
+	// byte offset where each chunk begins ; exact row starts if bounds_exact, else nominal offsets
+	std::vector< uint64_t > bounds;
+	bool bounds_exact;
+
+	// chunk k uses slots[ k % slots.size() ] ; worker threads may only start chunks < chunk_written + slots.size()
+	std::vector< chunk_slot > slots;
+	unsigned chunk_next;
+	unsigned chunk_written;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_done;
+	pthread_cond_t cond_free;
+
+	// byte range of chunk k
+	uint64_t chunk_begin ( unsigned k ) const;
+	uint64_t chunk_limit ( unsigned k ) const;
+
+	// guess the offset of the first row starting at or after off
+	uint64_t guess_row_start ( uint64_t off ) const;
+
+	// run the handler on all rows of chunk k, starting at offset first
+	void parse_chunk ( csv_reader *reader, unsigned k, uint64_t first, chunk_slot *slot );
+
+	void worker ( );
+	static void *worker_thread ( void *arg );
+
+public:
+	explicit parallel_reader ( const char *filename, const char sep = ',', const char quot = '"', const unsigned line_max = 64*1024, const unsigned nthreads = 2 );
+	~parallel_reader ( );
+
+	bool failed_to_open ( ) const;
+
+	// run handler on every row from offset start (a row start) to the end of the file, append the outputs to outbuf in file order
+	void run ( uint64_t start, chunk_handler handler, void *ctx, output_buffer *outbuf );
+
+private:
+	parallel_reader ( const parallel_reader& );
+	parallel_reader& operator=( const parallel_reader& );
+};
+
+#endif
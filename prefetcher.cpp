@@ -0,0 +1,219 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if !defined(NO_IO_URING) && !defined(__NR_io_uring_setup)
+#define NO_IO_URING
+#endif
+#ifndef NO_IO_URING
+#include <linux/io_uring.h>
+// IORING_OP_FADVISE (an enum, not testable) came with linux 5.6, along with this flag
+#ifndef IORING_FEAT_RW_CUR_POS
+#define NO_IO_URING
+#endif
+#endif
+
+#include "prefetcher.h"
+
+file_prefetcher::file_prefetcher ( unsigned entries ) :
+	ring_fd(-1),
+	sq_ptr(MAP_FAILED),
+	sq_size(0),
+	cq_ptr(MAP_FAILED),
+	cq_size(0),
+	sqes_ptr(MAP_FAILED),
+	sqes_size(0),
+	sq_tail(NULL),
+	sq_mask(NULL),
+	sq_array(NULL),
+	cq_head(NULL),
+	cq_tail(NULL),
+	cq_mask(NULL),
+	cqes(NULL),
+	sq_entries(0),
+	inflight_count(0)
+{
+	if ( ! setup_ring( entries ) )
+		close_ring();
+}
+
+file_prefetcher::~file_prefetcher ( )
+{
+	if ( ring_fd != -1 )
+		reap( inflight_count );
+
+	close_ring();
+}
+
+#ifndef NO_IO_URING
+bool file_prefetcher::setup_ring ( unsigned entries )
+{
+	struct io_uring_params p;
+	memset( &p, 0, sizeof(p) );
+
+	ring_fd = syscall( __NR_io_uring_setup, entries, &p );
+	if ( ring_fd == -1 )
+		return false;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		if ( cq_size > sq_size )
+			sq_size = cq_size;
+		cq_size = 0;
+	}
+
+	sq_ptr = mmap( NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING );
+	if ( sq_ptr == MAP_FAILED )
+		return false;
+
+	if ( cq_size )
+	{
+		cq_ptr = mmap( NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING );
+		if ( cq_ptr == MAP_FAILED )
+			return false;
+	}
+
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_ptr = mmap( NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES );
+	if ( sqes_ptr == MAP_FAILED )
+		return false;
+
+	char *sq = (char *)sq_ptr;
+	char *cq = (char *)( cq_size ? cq_ptr : sq_ptr );
+	sq_tail = (unsigned *)( sq + p.sq_off.tail );
+	sq_mask = (unsigned *)( sq + p.sq_off.ring_mask );
+	sq_array = (unsigned *)( sq + p.sq_off.array );
+	cq_head = (unsigned *)( cq + p.cq_off.head );
+	cq_tail = (unsigned *)( cq + p.cq_off.tail );
+	cq_mask = (unsigned *)( cq + p.cq_off.ring_mask );
+	cqes = cq + p.cq_off.cqes;
+	sq_entries = p.sq_entries;
+
+	inflight.assign( sq_entries, -1 );
+
+	return true;
+}
+
+void file_prefetcher::reap ( unsigned min_complete )
+{
+	if ( min_complete > 0 )
+		syscall( __NR_io_uring_enter, ring_fd, 0, min_complete, IORING_ENTER_GETEVENTS, NULL, 0 );
+
+	unsigned head = *cq_head;
+	while ( head != __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE ) )
+	{
+		const struct io_uring_cqe *cqe = (const struct io_uring_cqe *)cqes + ( head & *cq_mask );
+		unsigned idx = cqe->user_data;
+
+		if ( idx < inflight.size() && inflight[ idx ] != -1 )
+		{
+			// IORING_OP_FADVISE unsupported by this kernel (< 5.6)
+			if ( cqe->res == -EINVAL )
+				posix_fadvise( inflight[ idx ], 0, 0, POSIX_FADV_WILLNEED );
+
+			close( inflight[ idx ] );
+			inflight[ idx ] = -1;
+			--inflight_count;
+		}
+
+		++head;
+	}
+
+	__atomic_store_n( cq_head, head, __ATOMIC_RELEASE );
+}
+#else
+bool file_prefetcher::setup_ring ( unsigned )
+{
+	return false;
+}
+
+void file_prefetcher::reap ( unsigned )
+{
+}
+#endif
+
+void file_prefetcher::close_ring ( )
+{
+	for ( unsigned i = 0 ; i < inflight.size() ; ++i )
+		if ( inflight[ i ] != -1 )
+			close( inflight[ i ] );
+	inflight.clear();
+	inflight_count = 0;
+
+	if ( sqes_ptr != MAP_FAILED )
+		munmap( sqes_ptr, sqes_size );
+	if ( cq_ptr != MAP_FAILED )
+		munmap( cq_ptr, cq_size );
+	if ( sq_ptr != MAP_FAILED )
+		munmap( sq_ptr, sq_size );
+	sqes_ptr = cq_ptr = sq_ptr = MAP_FAILED;
+
+	if ( ring_fd != -1 )
+		close( ring_fd );
+	ring_fd = -1;
+}
+
+void file_prefetcher::prefetch ( const char *filename )
+{
+	if ( !filename || ( filename[ 0 ] == '-' && filename[ 1 ] == 0 ) )
+		return;
+
+	int fd = open( filename, O_RDONLY );
+	if ( fd == -1 )
+		return;
+
+	struct stat st;
+	if ( fstat( fd, &st ) || !S_ISREG( st.st_mode ) || st.st_size == 0 )
+	{
+		close( fd );
+		return;
+	}
+
+	if ( ring_fd == -1 )
+	{
+		posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+		close( fd );
+		return;
+	}
+
+#ifndef NO_IO_URING
+	// make room for one more advice
+	reap( inflight_count >= sq_entries ? 1 : 0 );
+
+	unsigned idx = 0;
+	while ( inflight[ idx ] != -1 )
+		++idx;
+
+	unsigned tail = *sq_tail;
+	unsigned slot = tail & *sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes_ptr + slot;
+	memset( sqe, 0, sizeof(*sqe) );
+	sqe->opcode = IORING_OP_FADVISE;
+	sqe->fd = fd;
+	sqe->off = 0;
+	sqe->len = 0;	// up to the end of the file
+	sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+	sqe->user_data = idx;
+	sq_array[ slot ] = slot;
+	__atomic_store_n( sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+	if ( syscall( __NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0 ) != 1 )
+	{
+		// submission failed, the sqe was not consumed: give up the ring
+		__atomic_store_n( sq_tail, tail, __ATOMIC_RELEASE );
+		posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+		close( fd );
+		close_ring();
+		return;
+	}
+
+	inflight[ idx ] = fd;
+	++inflight_count;
+#endif
+}
@@ -0,0 +1,59 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <vector>
+#include <stddef.h>
+
+/*
+ * Warm the page cache for files that will be read soon
+ *
+ * For each file, a POSIX_FADV_WILLNEED advice is queued on an io_uring, so that the kernel reads the file in the background
+ * while the caller is busy with the previous ones. Submitting the advice does not block the caller.
+ * If io_uring is not available (old kernel, seccomp filter, compiled with -DNO_IO_URING), fall back to posix_fadvise().
+ */
+class file_prefetcher
+{
+private:
+	// io_uring file descriptor, -1 when using the posix_fadvise fallback
+	int ring_fd;
+
+	// mmapped rings
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	void *sqes_ptr;
+	size_t sqes_size;
+
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes;
+	unsigned sq_entries;
+
+	// file descriptors of the queued advices, indexed by sqe user_data ; -1 for free entries
+	std::vector< int > inflight;
+	unsigned inflight_count;
+
+	bool setup_ring ( unsigned entries );
+	void close_ring ( );
+
+	// handle completed advices, wait for at least min_complete of them
+	void reap ( unsigned min_complete );
+
+public:
+	explicit file_prefetcher ( unsigned entries = 16 );
+	~file_prefetcher ( );
+
+	// start reading a file in the background ; ignores non-regular files and errors
+	void prefetch ( const char *filename );
+
+private:
+	file_prefetcher ( const file_prefetcher& );
+	file_prefetcher& operator=( const file_prefetcher& );
+};
+
+#endif
@@ -0,0 +1,554 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+
+#include "row_index.h"
+
+// uncompressed distance between two checkpoints (gzip files)
+static const uint64_t index_span = 8*1024*1024;
+
+// rows between two checkpoints (uncompressed files)
+static const uint64_t index_rows = 16384;
+
+// inflate window size
+static const unsigned window_size = 32*1024;
+
+static const char index_magic[ 8 ] = { 'C', 'S', 'V', 'I', 'D', 'X', '2', '\n' };
+
+// find row boundaries in a csv stream, with the same rules as the csv_reader scalar parser
+class row_tracker
+{
+private:
+	enum {
+		FIELD_START,
+		UNQUOTED,
+		QUOTED,
+		QUOTED_QUOTE,	// quote inside a quoted field: end quote or escaped quote
+		SYNTAX_ERROR,	// end quote followed by garbage: the rest of the line is ignored
+	};
+
+	char sep;
+	char quot;
+	int state;
+	bool at_line_start;
+
+public:
+	// number of rows ended so far
+	uint64_t rows;
+
+	explicit row_tracker ( const char sep, const char quot ) :
+		sep(sep),
+		quot(quot),
+		state(FIELD_START),
+		at_line_start(true),
+		rows(0)
+	{
+	}
+
+	// true if the next byte starts a row
+	bool at_row_start ( ) const
+	{
+		return at_line_start;
+	}
+
+	// scan len bytes, return the offset after the first row end found, or len if none
+	size_t scan ( const char *p, size_t len )
+	{
+		for ( size_t i = 0 ; i < len ; ++i )
+		{
+			const char c = p[ i ];
+			at_line_start = false;
+
+			switch ( state )
+			{
+			case FIELD_START:
+				if ( c == quot )
+					state = QUOTED;
+				else if ( c != sep && c != '\n' )
+					state = UNQUOTED;
+				break;
+
+			case UNQUOTED:
+				if ( c == sep )
+					state = FIELD_START;
+				break;
+
+			case QUOTED:
+				if ( c == quot )
+					state = QUOTED_QUOTE;
+				break;
+
+			case QUOTED_QUOTE:
+				if ( c == quot )
+					state = QUOTED;
+				else if ( c == sep )
+					state = FIELD_START;
+				else if ( c != '\r' && c != '\n' )
+					state = SYNTAX_ERROR;
+				break;
+			}
+
+			if ( c == '\n' && state != QUOTED )
+			{
+				state = FIELD_START;
+				at_line_start = true;
+				++rows;
+				return i + 1;
+			}
+		}
+
+		return len;
+	}
+};
+
+row_index::row_index ( ) :
+	sep(','),
+	quot('"'),
+	compressed(false),
+	file_size(0),
+	file_mtime(0),
+	file_mtime_ns(0)
+{
+}
+
+std::string row_index::index_path ( const char *filename )
+{
+	return std::string( filename ) + ".csvidx";
+}
+
+bool row_index::file_stat ( const char *filename, uint64_t *size, int64_t *mtime, int64_t *mtime_ns )
+{
+	struct stat st;
+	if ( stat( filename, &st ) || !S_ISREG( st.st_mode ) )
+		return false;
+
+	*size = st.st_size;
+	*mtime = st.st_mtim.tv_sec;
+	*mtime_ns = st.st_mtim.tv_nsec;
+
+	return true;
+}
+
+bool row_index::is_compressed ( ) const
+{
+	return compressed;
+}
+
+void row_index::row_offsets ( std::vector< uint64_t > *offsets ) const
+{
+	offsets->clear();
+	for ( size_t i = 0 ; i < points.size() ; ++i )
+		offsets->push_back( points[ i ].row_off );
+}
+
+const row_checkpoint *row_index::find ( uint64_t row ) const
+{
+	// binary search the last point with point.row <= row
+	size_t lo = 0;
+	size_t hi = points.size();
+	while ( lo < hi )
+	{
+		size_t mid = ( lo + hi ) / 2;
+		if ( points[ mid ].row <= row )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ( lo == 0 )
+		return NULL;
+
+	return &points[ lo - 1 ];
+}
+
+bool row_index::build ( const char *filename, const char sep, const char quot )
+{
+	this->sep = sep;
+	this->quot = quot;
+	points.clear();
+
+	if ( ! file_stat( filename, &file_size, &file_mtime, &file_mtime_ns ) )
+	{
+		std::cerr << "Cannot index " << filename << ": not a regular file" << std::endl;
+		return false;
+	}
+
+	std::ifstream input( filename, std::ios::in | std::ios::binary );
+	if ( ! input )
+	{
+		std::cerr << "Cannot open " << filename << ": " << strerror( errno ) << std::endl;
+		return false;
+	}
+
+	char magic[ 32 ];
+	input.read( magic, sizeof(magic) );
+	size_t magic_len = input.gcount();
+	input.clear();
+	input.seekg( 0 );
+
+	int mode = block_reader::compression_mode( magic, magic_len );
+	if ( mode != block_reader::MODE_RAW && mode != block_reader::MODE_GZIP && mode != block_reader::MODE_BGZF )
+	{
+		std::cerr << "Cannot index zstd/lz4 files" << std::endl;
+		return false;
+	}
+
+	compressed = ( mode != block_reader::MODE_RAW );
+	if ( compressed )
+		return build_gzip( input );
+
+	return build_plain( filename );
+}
+
+// record the offset of every index_rows-th row
+bool row_index::build_plain ( const char *filename )
+{
+	if ( file_size == 0 )
+		return true;
+
+	int fd = open( filename, O_RDONLY );
+	if ( fd == -1 )
+	{
+		std::cerr << "Cannot open " << filename << ": " << strerror( errno ) << std::endl;
+		return false;
+	}
+
+	void *ptr = mmap( NULL, file_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( ptr == MAP_FAILED )
+	{
+		std::cerr << "Cannot mmap " << filename << ": " << strerror( errno ) << std::endl;
+		return false;
+	}
+	madvise( ptr, file_size, MADV_SEQUENTIAL );
+
+	const char *map = (const char *)ptr;
+	row_tracker tracker( sep, quot );
+	row_checkpoint cp;
+	cp.in_off = 0;
+	cp.point.bits = 0;
+
+	for ( uint64_t off = 0 ; off < file_size ; )
+	{
+		off += tracker.scan( map + off, file_size - off );
+		if ( tracker.at_row_start() && tracker.rows % index_rows == 0 && off < file_size )
+		{
+			cp.row = tracker.rows;
+			cp.row_off = cp.out_off = off;
+			points.push_back( cp );
+		}
+	}
+
+	munmap( ptr, file_size );
+
+	return true;
+}
+
+#ifndef NO_ZLIB
+bool row_index::build_gzip ( std::istream &input )
+{
+	z_stream zs;
+	memset( &zs, 0, sizeof(zs) );
+	if ( inflateInit2( &zs, 32 | 15 ) != Z_OK )
+	{
+		std::cerr << "inflateInit: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+		return false;
+	}
+
+	std::vector< char > zin( 256*1024 );
+	std::vector< char > window( window_size );
+	row_tracker tracker( sep, quot );
+
+	uint64_t totin = 0;
+	uint64_t totout = 0;
+	uint64_t last = 0;
+	// checkpoint waiting for the next row start
+	row_checkpoint cp;
+	bool pending = false;
+	bool input_end = false;
+	bool ok = true;
+
+	zs.avail_out = 0;
+	while ( 1 )
+	{
+		if ( zs.avail_in == 0 && !input_end )
+		{
+			input.read( &zin[ 0 ], zin.size() );
+			zs.avail_in = input.gcount();
+			zs.next_in = (Bytef *)&zin[ 0 ];
+			if ( zs.avail_in == 0 )
+				input_end = true;
+		}
+
+		if ( zs.avail_out == 0 )
+		{
+			zs.next_out = (Bytef *)&window[ 0 ];
+			zs.avail_out = window_size;
+		}
+
+		unsigned in_before = zs.avail_in;
+		const char *out_start = (const char *)zs.next_out;
+		int ret = inflate( &zs, Z_BLOCK );
+		if ( ret == Z_BUF_ERROR && input_end )
+		{
+			std::cerr << "inflate: unexpected end of file" << std::endl;
+			ok = false;
+			break;
+		}
+		else if ( ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR )
+		{
+			std::cerr << "inflate: " << ( zs.msg ? zs.msg : "error" ) << std::endl;
+			ok = false;
+			break;
+		}
+
+		totin += in_before - zs.avail_in;
+
+		// track rows in the new output
+		const char *p = out_start;
+		const char *out_end = (const char *)zs.next_out;
+		while ( p < out_end )
+		{
+			size_t n = tracker.scan( p, out_end - p );
+			p += n;
+			if ( pending && tracker.at_row_start() )
+			{
+				cp.row = tracker.rows;
+				cp.row_off = totout + ( p - out_start );
+				points.push_back( cp );
+				pending = false;
+			}
+		}
+		totout += out_end - out_start;
+
+		if ( ret == Z_STREAM_END )
+		{
+			// another gzip member ?
+			if ( zs.avail_in == 0 && input.peek() == EOF )
+				break;
+			inflateReset( &zs );
+			continue;
+		}
+
+		// end of a deflate block, not the last one: record a checkpoint
+		if ( ( zs.data_type & 128 ) && !( zs.data_type & 64 ) && !pending && totout - last >= index_span )
+		{
+			cp.out_off = totout;
+			cp.in_off = totin;
+			cp.point.bits = zs.data_type & 7;
+
+			// last 32KB of output, in order
+			size_t wpos = window_size - zs.avail_out;
+			size_t wlen = ( totout < window_size ? totout : window_size );
+			cp.point.window.clear();
+			if ( wlen > wpos )
+				cp.point.window.append( &window[ window_size - ( wlen - wpos ) ], wlen - wpos );
+			cp.point.window.append( &window[ wpos - ( wlen < wpos ? wlen : wpos ) ], ( wlen < wpos ? wlen : wpos ) );
+
+			last = totout;
+			pending = true;
+			if ( tracker.at_row_start() )
+			{
+				cp.row = tracker.rows;
+				cp.row_off = totout;
+				points.push_back( cp );
+				pending = false;
+			}
+		}
+	}
+
+	inflateEnd( &zs );
+
+	return ok;
+}
+#else
+bool row_index::build_gzip ( std::istream & )
+{
+	std::cerr << "Cannot index gzip files: compiled without zlib" << std::endl;
+	return false;
+}
+#endif
+
+bool row_index::save ( const char *filename ) const
+{
+	std::string path = index_path( filename );
+	std::ofstream out( path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+	if ( ! out )
+	{
+		std::cerr << "Cannot open " << path << ": " << strerror( errno ) << std::endl;
+		return false;
+	}
+
+	// native byte order
+	uint64_t count = points.size();
+	char kind = ( compressed ? 'z' : 'p' );
+	out.write( index_magic, sizeof(index_magic) );
+	out.write( (const char *)&file_size, sizeof(file_size) );
+	out.write( (const char *)&file_mtime, sizeof(file_mtime) );
+	out.write( (const char *)&file_mtime_ns, sizeof(file_mtime_ns) );
+	out.write( &sep, 1 );
+	out.write( &quot, 1 );
+	out.write( &kind, 1 );
+	out.write( (const char *)&count, sizeof(count) );
+
+	for ( size_t i = 0 ; i < points.size() ; ++i )
+	{
+		const row_checkpoint &cp = points[ i ];
+
+		if ( ! compressed )
+		{
+			// row number and offset only
+			out.write( (const char *)&cp.row, sizeof(cp.row) );
+			out.write( (const char *)&cp.row_off, sizeof(cp.row_off) );
+			continue;
+		}
+
+		uint32_t bits = cp.point.bits;
+		uint32_t wlen = cp.point.window.size();
+		std::string wz;
+
+#ifndef NO_ZLIB
+		// windows are stored deflated
+		uLongf zlen = compressBound( wlen );
+		wz.resize( zlen );
+		if ( compress2( (Bytef *)&wz[ 0 ], &zlen, (const Bytef *)cp.point.window.data(), wlen, 6 ) != Z_OK )
+			zlen = 0;
+		wz.resize( zlen );
+#endif
+		uint32_t wzlen = wz.size();
+
+		out.write( (const char *)&cp.row, sizeof(cp.row) );
+		out.write( (const char *)&cp.row_off, sizeof(cp.row_off) );
+		out.write( (const char *)&cp.out_off, sizeof(cp.out_off) );
+		out.write( (const char *)&cp.in_off, sizeof(cp.in_off) );
+		out.write( (const char *)&bits, sizeof(bits) );
+		out.write( (const char *)&wlen, sizeof(wlen) );
+		out.write( (const char *)&wzlen, sizeof(wzlen) );
+		out.write( wz.data(), wzlen );
+	}
+
+	out.close();
+	if ( ! out )
+	{
+		std::cerr << "Cannot write " << path << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool row_index::load ( const char *filename, const char sep, const char quot )
+{
+	points.clear();
+
+	if ( ! filename || ! file_stat( filename, &file_size, &file_mtime, &file_mtime_ns ) )
+		return false;
+
+	std::string path = index_path( filename );
+	std::ifstream in( path.c_str(), std::ios::in | std::ios::binary );
+	if ( ! in )
+		return false;
+
+	char magic[ sizeof(index_magic) ];
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	int64_t mtime_ns = 0;
+	uint64_t count = 0;
+	char kind = 0;
+	in.read( magic, sizeof(magic) );
+	in.read( (char *)&size, sizeof(size) );
+	in.read( (char *)&mtime, sizeof(mtime) );
+	in.read( (char *)&mtime_ns, sizeof(mtime_ns) );
+	in.read( &this->sep, 1 );
+	in.read( &this->quot, 1 );
+	in.read( &kind, 1 );
+	in.read( (char *)&count, sizeof(count) );
+
+	if ( ! in || memcmp( magic, index_magic, sizeof(magic) ) || size != file_size || mtime != file_mtime || mtime_ns != file_mtime_ns ||
+			this->sep != sep || this->quot != quot || ( kind != 'z' && kind != 'p' ) )
+		return false;
+
+	compressed = ( kind == 'z' );
+
+	// a corrupt count must not make us reserve or loop more than what the index file can hold
+	const std::streampos header_end = in.tellg();
+	in.seekg( 0, std::ios::end );
+	const std::streampos index_end = in.tellg();
+	in.seekg( header_end );
+	// row, row_off (, out_off, in_off, bits, wlen, wzlen)
+	const uint64_t entry_min = ( compressed ? 4*sizeof(uint64_t) + 3*sizeof(uint32_t) : 2*sizeof(uint64_t) );
+	if ( ! in || index_end < header_end || count > (uint64_t)( index_end - header_end ) / entry_min )
+		return false;
+
+	points.reserve( count );
+
+	for ( uint64_t i = 0 ; i < count ; ++i )
+	{
+		row_checkpoint cp;
+		uint32_t bits = 0, wlen = 0, wzlen = 0;
+
+		if ( ! compressed )
+		{
+			in.read( (char *)&cp.row, sizeof(cp.row) );
+			in.read( (char *)&cp.row_off, sizeof(cp.row_off) );
+			if ( ! in )
+			{
+				points.clear();
+				return false;
+			}
+			cp.out_off = cp.row_off;
+			cp.in_off = 0;
+			cp.point.bits = 0;
+			points.push_back( cp );
+			continue;
+		}
+
+		in.read( (char *)&cp.row, sizeof(cp.row) );
+		in.read( (char *)&cp.row_off, sizeof(cp.row_off) );
+		in.read( (char *)&cp.out_off, sizeof(cp.out_off) );
+		in.read( (char *)&cp.in_off, sizeof(cp.in_off) );
+		in.read( (char *)&bits, sizeof(bits) );
+		in.read( (char *)&wlen, sizeof(wlen) );
+		in.read( (char *)&wzlen, sizeof(wzlen) );
+		if ( ! in || bits > 7 || wlen > window_size || wzlen > 2*window_size )
+		{
+			points.clear();
+			return false;
+		}
+
+		std::string wz( wzlen, 0 );
+		if ( wzlen )
+			in.read( &wz[ 0 ], wzlen );
+		if ( ! in )
+		{
+			points.clear();
+			return false;
+		}
+
+		cp.point.bits = bits;
+		cp.point.window.resize( wlen );
+#ifndef NO_ZLIB
+		uLongf len = wlen;
+		if ( wlen && ( uncompress( (Bytef *)&cp.point.window[ 0 ], &len, (const Bytef *)wz.data(), wzlen ) != Z_OK || len != wlen ) )
+#else
+		if ( wlen )
+#endif
+		{
+			points.clear();
+			return false;
+		}
+
+		points.push_back( cp );
+	}
+
+	return true;
+}
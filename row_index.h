@@ -0,0 +1,78 @@
+#ifndef ROW_INDEX_H
+#define ROW_INDEX_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+
+#include "block_reader.h"
+
+// a point of a csv file where parsing can start
+struct row_checkpoint {
+	uint64_t row;		// number of the first row starting at or after out_off (first row of the file = 0)
+	uint64_t row_off;	// offset of this row in the uncompressed stream
+	uint64_t out_off;	// uncompressed offset of the inflate resume point
+	uint64_t in_off;	// compressed offset of the inflate resume point (input bytes consumed, see point.bits)
+	block_reader::inflate_point point;
+};
+
+/*
+ * Sidecar index of a csv file, stored in <file>.csvidx
+ *
+ * For uncompressed files, the index records the offset of every few thousand rows. This allows to seek to a row without
+ * parsing the beginning of the file, and to split the file in row-aligned chunks for parallel parsing.
+ *
+ * For gzip compressed files, every few MB of uncompressed data, at a deflate block boundary, the index records the inflate
+ * state (input position and the last 32KB of output, as in zlib's zran example) along with the number and offset of the next row.
+ * This allows to start parsing from the middle of the file, inflating only from the closest checkpoint.
+ *
+ * Rows are counted with the same rules as csv_reader (quoted fields may span many lines).
+ * The index is only used if the file size and modification time (to the nanosecond) match those recorded when it was built.
+ */
+class row_index
+{
+private:
+	char sep;
+	char quot;
+	bool compressed;
+	uint64_t file_size;
+	int64_t file_mtime;
+	int64_t file_mtime_ns;
+	std::vector< row_checkpoint > points;
+
+	// get the size and mtime (seconds and nanoseconds) of a file
+	static bool file_stat ( const char *filename, uint64_t *size, int64_t *mtime, int64_t *mtime_ns );
+
+	bool build_plain ( const char *filename );
+	bool build_gzip ( std::istream &input );
+
+public:
+	explicit row_index ( );
+
+	static std::string index_path ( const char *filename );
+
+	// build the index of a file (gzip or uncompressed)
+	bool build ( const char *filename, const char sep = ',', const char quot = '"' );
+
+	// write the index in the sidecar file
+	bool save ( const char *filename ) const;
+
+	// read the sidecar file of filename, return false if it does not exist or does not match the file / csv format
+	bool load ( const char *filename, const char sep = ',', const char quot = '"' );
+
+	// return the last checkpoint before row, or NULL
+	const row_checkpoint *find ( uint64_t row ) const;
+
+	// true if the index describes a gzip file, whose checkpoints need an inflate restart
+	bool is_compressed ( ) const;
+
+	// get the row start offsets of the checkpoints
+	void row_offsets ( std::vector< uint64_t > *offsets ) const;
+
+private:
+	row_index ( const row_index& );
+	row_index& operator=( const row_index& );
+};
+
+#endif
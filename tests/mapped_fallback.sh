@@ -0,0 +1,28 @@
+#!/bin/sh
+# rows with a row index, and the copy_file_range/sendfile passthrough of rows, rename and stripheader, need a mapped input:
+# check that the unmapped paths (-R, stdin) give the same output, so a fallback is only slower
+
+CSV=${CSV:-./csv}
+TMP=${TMPDIR:-/tmp}/csv_test.$$
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' 0
+
+awk 'BEGIN { print "a,b,c" ; for ( i = 0 ; i < 300000 ; ++i ) printf "%d,\"x,%s\",%d\n", i, substr( "yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy", 1, i % 61 ), i * 7 }' > $TMP/in.csv
+$CSV index $TMP/in.csv || exit 1
+
+fail=0
+for args in "rows 250000-250100" "rows 1000-" "rename a=z" "stripheader"
+do
+	$CSV $args $TMP/in.csv > $TMP/mapped.csv
+	for alt in "-R $args $TMP/in.csv" "$args"
+	do
+		if ! $CSV $alt < $TMP/in.csv > $TMP/out.csv || ! cmp -s $TMP/out.csv $TMP/mapped.csv
+		then
+			echo "FAIL: csv $alt"
+			fail=1
+		fi
+	done
+done
+
+[ $fail = 0 ] && echo "mapped_fallback: ok"
+exit $fail
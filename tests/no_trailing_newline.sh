@@ -0,0 +1,51 @@
+#!/bin/sh
+# the last row of an input may lack its newline, even when it is the first (and only) row of a block:
+# check that decompressed (gzip, zstd, lz4) and read-ahead (-R) inputs still return it
+
+CSV=${CSV:-./csv}
+TMP=${TMPDIR:-/tmp}/csv_test.$$
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' 0
+
+printf 'a,b' > $TMP/h.csv
+gzip -c $TMP/h.csv > $TMP/h.csv.gz
+printf 'a\r\nb\r\n' > $TMP/expected_listcol.csv
+printf 'x\n1,2' > $TMP/r.csv
+gzip -c $TMP/r.csv > $TMP/r.csv.gz
+printf '1,2\r\n' > $TMP/expected_rows.csv
+
+# zstd and lz4 are only tested when both the compressor and csv support for them (NO_ZSTD, NO_LZ4) are available
+printf 'a,b\n' > $TMP/probe.csv
+inputs="h.csv.gz"
+for ext in zst lz4
+do
+	[ $ext = zst ] && z=zstd || z=lz4
+	command -v $z >/dev/null 2>&1 || continue
+	$z -q -c $TMP/h.csv > $TMP/h.csv.$ext
+	$z -q -c $TMP/probe.csv > $TMP/probe.csv.$ext
+	$CSV listcol $TMP/probe.csv.$ext 2>/dev/null | cmp -s - $TMP/expected_listcol.csv && inputs="$inputs h.csv.$ext"
+done
+
+fail=0
+check ( )
+{
+	expected=$1
+	shift
+	if ! $CSV "$@" > $TMP/out.csv || ! cmp -s $TMP/out.csv $TMP/$expected
+	then
+		echo "FAIL: csv $*"
+		fail=1
+	fi
+}
+
+for in in $inputs
+do
+	check expected_listcol.csv listcol $TMP/$in
+	check expected_listcol.csv -R listcol $TMP/$in
+done
+check expected_listcol.csv -R listcol $TMP/h.csv
+check expected_rows.csv -H rows 1 $TMP/r.csv.gz
+check expected_rows.csv -R -H rows 1 $TMP/r.csv
+
+[ $fail = 0 ] && echo "no_trailing_newline: ok"
+exit $fail
@@ -0,0 +1,26 @@
+#!/bin/sh
+# rename copies the rows after the header with raw reads of 64KB, larger than the line buffer when -L is small:
+# check that decompressed (gzip) and read-ahead (-R) inputs come out unchanged
+# (build with CCOPTS="-g -fsanitize=address" LDOPTS="-lz -lpthread -fsanitize=address" to catch overflows)
+
+CSV=${CSV:-./csv}
+TMP=${TMPDIR:-/tmp}/csv_test.$$
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' 0
+
+awk 'BEGIN { print "a,b,c" ; for ( i = 0 ; i < 200000 ; ++i ) printf "%d,%s,%d\n", i, substr( "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 1, i % 61 ), i * 7 }' > $TMP/in.csv
+gzip -c $TMP/in.csv > $TMP/in.csv.gz
+{ printf "z,b,c\r\n" ; tail -n +2 $TMP/in.csv ; } > $TMP/expected.csv
+
+fail=0
+for args in "-L 1000 rename a=z $TMP/in.csv.gz" "-R -L 1000 rename a=z $TMP/in.csv" "-R -L 1000 rename a=z $TMP/in.csv.gz"
+do
+	if ! $CSV $args > $TMP/out.csv || ! cmp -s $TMP/out.csv $TMP/expected.csv
+	then
+		echo "FAIL: csv $args"
+		fail=1
+	fi
+done
+
+[ $fail = 0 ] && echo "rename_small_line_max: ok"
+exit $fail